@@ -26,8 +26,8 @@
 #include <string.h>
 #include <stdlib.h>
 #include <stdio.h>
-#include "zlib.h"
 #include "bsa_parser.h"
+#include "zip_codec.h"
 #include "libtes4vfs.h"
 
 using namespace std;
@@ -71,25 +71,11 @@ static int extract_zip_data(BSAFileInfo wht, MFILE from, unsigned char** to)
 		return -11;
 	}
 
-	z_stream strm;
-	memset(&strm,0,sizeof(strm));
-	if (inflateInit(&strm) != Z_OK) {
-		delete[] rdbuf;
-		return -2;
-	}
-
 	*to = new unsigned char[fin_len];
-
-	strm.avail_in = in_len;
-	strm.next_in = rdbuf;
-	strm.avail_out = fin_len;
-	strm.next_out = *to;
-
-	int r = inflate(&strm,Z_FINISH);
-	inflateEnd(&strm);
+	bool ok = get_zip_codec()->inflate(rdbuf,in_len,*to,fin_len);
 	delete[] rdbuf;
 
-	if (r != Z_STREAM_END) {
+	if (!ok) {
 		delete[] (*to);
 		return -3;
 	}
@@ -0,0 +1,389 @@
+/*
+ * TES4 data file library.
+ * (C) Dmitry 'MatrixS_Master' Solovyev, 2015-2019. All rights reserved.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights to
+ * use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies
+ * of the Software, and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED,
+ * INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A
+ * PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+ * HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+ * OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ *
+ */
+
+#include <vector>
+#include <mutex>
+#include <stdio.h>
+#include "esp_cache.h"
+
+#ifndef TES4LIB_USE_VFS
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+using namespace std;
+namespace TES4 {
+
+static string esp_cache_dir;
+static mutex esp_cache_mtx;
+
+void set_esp_cache_dir(string const &dir)
+{
+	lock_guard<mutex> lk(esp_cache_mtx);
+	esp_cache_dir = dir;
+}
+
+string get_esp_cache_dir()
+{
+	lock_guard<mutex> lk(esp_cache_mtx);
+	return esp_cache_dir;
+}
+
+#ifndef TES4LIB_USE_VFS
+
+static shared_ptr<const uint8_t> map_file(string const &fn, size_t &len, struct stat &st)
+{
+	shared_ptr<const uint8_t> res;
+	len = 0;
+	int fd = open(fn.c_str(),O_RDONLY);
+	if (fd < 0) return res;
+	
+	if (!fstat(fd,&st) && st.st_size > 0) {
+		size_t l = st.st_size;
+		void* ptr = mmap(NULL,l,PROT_READ,MAP_PRIVATE,fd,0);
+		if (ptr != MAP_FAILED) {
+			len = l;
+			res = shared_ptr<const uint8_t>((const uint8_t*)ptr,[l] (const uint8_t* p) { munmap((void*)p,l); });
+		}
+	}
+	close(fd);
+	return res;
+}
+
+string esp_snapshot_name(string const &dir, string const &src)
+{
+	//FNV-1a of the path
+	uint64_t h = 14695981039346656037ULL;
+	for (char c : src) {
+		h ^= (uint8_t)c;
+		h *= 1099511628211ULL;
+	}
+	
+	char buf[32];
+	snprintf(buf,sizeof(buf),"%016llx.snap",(unsigned long long)h);
+	string res = dir;
+	if (!res.empty() && res[res.length()-1] != '/') res += '/';
+	return res + buf;
+}
+
+/* Flattens the tree in depth-first order. Payloads found in the mapped source are referenced,
+ * the rest (inflated bodies, owned copies) goes into the blob. */
+struct ESPSnapBuilder {
+	const uint8_t* src;
+	size_t src_len;
+	vector<ESPSnapNode> nodes;
+	vector<ESPSnapSub> subs;
+	vector<uint8_t> blob;
+	
+	//offset in the source + 1, or 0 if it's not there
+	uint64_t locate(const uint8_t* p, size_t len) const {
+		return (p && p >= src && len <= src_len && p - src <= (ptrdiff_t)(src_len - len))? (p - src) + 1 : 0;
+	}
+	
+	bool add(MyRecord &rc);
+	bool add(MyGroup &grp);
+};
+
+bool ESPSnapBuilder::add(MyRecord &rc)
+{
+	ESPSnapNode n;
+	memset(&n,0,sizeof(n));
+	n.hdr.rec = rc.rec;
+	if (record_intact(rc) && (n.orig = locate(rc.orig,rc.origLen))) n.origLen = rc.origLen;
+	
+	//compressed records are stored inflated, without touching the tree itself
+	MyRecord tmp;
+	MyRecord* from = &rc;
+	if (rc.packed()) {
+		tmp.rec = rc.rec;
+		tmp.data.push_back(rc.data[0]);
+		if (unpack_record(tmp) < 1) return false;
+		from = &tmp;
+	}
+	
+	n.first = subs.size();
+	n.count = from->data.size();
+	nodes.push_back(n);
+	
+	//inflated bodies of clean compressed records are laid out as they were, so they'd still be found intact
+	bool tile = n.orig && (rc.rec.flags & REC_FLG_ZIP);
+	for (auto &&i : from->data) {
+		ESPSnapSub s;
+		memset(&s,0,sizeof(s));
+		s.hdr = i.rec;
+		s.kludgeSize = i.kludgeSize;
+		s.len = i.length();
+		if ((s.off = locate(i.bytes(),s.len)))
+			s.off--;
+		else {
+			s.inBlob = 1;
+			if (tile) blob.insert(blob.end(),(const uint8_t*)&(i.rec),(const uint8_t*)&(i.rec)+sizeof(i.rec));
+			s.off = blob.size();
+			if (s.len) blob.insert(blob.end(),i.bytes(),i.bytes()+s.len);
+		}
+		subs.push_back(s);
+	}
+	return true;
+}
+
+bool ESPSnapBuilder::add(MyGroup &grp)
+{
+	ESPSnapNode n;
+	memset(&n,0,sizeof(n));
+	n.isGroup = 1;
+	n.hdr.grp = grp.grp;
+	n.count = grp.data.size();
+	if (grp.orig) {
+		TES4Group hdr;
+		memcpy(&hdr,grp.orig,sizeof(hdr));
+		if ((n.orig = locate(grp.orig,hdr.groupSize))) n.origLen = hdr.groupSize;
+	}
+	nodes.push_back(n);
+	
+	for (auto &&i : grp.data)
+		if (!(i.isGroup? add(*(i.data.grp)) : add(*(i.data.rec)))) return false;
+	return true;
+}
+
+static bool write_snapshot(MyESP &data, string const &src, string const &snap, struct stat const &st)
+{
+	//(an incomplete tree would come back from the snapshot as a complete one)
+	if (!data.source || !data.complete) return false;
+	
+	ESPSnapBuilder b;
+	b.src = data.source.get();
+	b.src_len = data.source_len;
+	for (auto &&i : data.recs)
+		if (!b.add(i)) return false;
+	for (auto &&i : data.grps)
+		if (!b.add(i)) return false;
+	
+	ESPSnapHeader hdr;
+	memset(&hdr,0,sizeof(hdr));
+	memcpy(hdr.magic,ESP_SNAP_MAGIC,sizeof(hdr.magic));
+	hdr.version = ESP_SNAP_VERSION;
+	hdr.pathLen = src.length();
+	hdr.nodeSize = sizeof(ESPSnapNode);
+	hdr.subSize = sizeof(ESPSnapSub);
+	hdr.srcSize = st.st_size;
+	hdr.srcMTime = st.st_mtim.tv_sec;
+	hdr.srcMTimeNs = st.st_mtim.tv_nsec;
+	hdr.nodes = b.nodes.size();
+	hdr.subs = b.subs.size();
+	hdr.blobLen = b.blob.size();
+	hdr.topRecs = data.recs.size();
+	hdr.topGrps = data.grps.size();
+	
+	//written aside and renamed, so nobody would ever map a partial snapshot
+	string tmp = snap + "." + to_string(getpid()) + ".tmp";
+	FILE* f = fopen(tmp.c_str(),"wb");
+	if (!f) return false;
+	
+	auto put = [f] (const void* p, size_t len) { return !len || fwrite(p,len,1,f) == 1; };
+	static const uint8_t pad[8] = {0};
+	bool ok = put(&hdr,sizeof(hdr)) && put(src.data(),src.length()) && put(pad,(8 - src.length() % 8) % 8)
+			&& put(b.nodes.data(),b.nodes.size() * sizeof(ESPSnapNode))
+			&& put(b.subs.data(),b.subs.size() * sizeof(ESPSnapSub))
+			&& put(b.blob.data(),b.blob.size());
+	
+	if (fclose(f)) ok = false;
+	if (ok) ok = !rename(tmp.c_str(),snap.c_str());
+	if (!ok) unlink(tmp.c_str());
+	return ok;
+}
+
+bool write_esp_snapshot(MyESP &data, string const &src, string const &snap)
+{
+	struct stat st;
+	if (stat(src.c_str(),&st)) return false;
+	return write_snapshot(data,src,snap,st);
+}
+
+//rebuilds the tree from the tables (every offset is checked, so a damaged snapshot is just a miss)
+struct ESPSnapLoader {
+	MyESP &data;
+	const ESPSnapNode* nodes;
+	const ESPSnapSub* subs;
+	const uint8_t* blob;
+	const uint8_t* src;
+	uint64_t nnodes, nsubs, blob_len, src_len;
+	uint64_t pos = 0;
+	
+	ESPSnapLoader(MyESP &d) : data(d) {}
+	
+	const ESPSnapNode* next() {
+		return (pos < nnodes)? nodes + (pos++) : NULL;
+	}
+	
+	bool fill(MyRecord &rc, const ESPSnapNode &n);
+	bool fill(MyGroup &grp, const ESPSnapNode &n);
+};
+
+bool ESPSnapLoader::fill(MyRecord &rc, const ESPSnapNode &n)
+{
+	if (n.isGroup || n.first > nsubs || n.count > nsubs - n.first) return false;
+	if (n.orig && (n.orig - 1 > src_len || n.origLen > src_len - (n.orig - 1))) return false;
+	
+	rc.rec = n.hdr.rec;
+	if (n.orig) {
+		rc.orig = src + (n.orig - 1);
+		rc.origLen = n.origLen;
+	}
+	
+	MySubRecord::allocator_type alloc(rc.data.get_allocator());
+	rc.data.reserve(n.count);
+	for (const ESPSnapSub* s = subs + n.first; s < subs + n.first + n.count; s++) {
+		const uint8_t* base = s->inBlob? blob : src;
+		uint64_t lim = s->inBlob? blob_len : src_len;
+		if (s->off > lim || s->len > lim - s->off) return false;
+		
+		MySubRecord srec(alloc);
+		srec.rec = s->hdr;
+		srec.kludgeSize = s->kludgeSize;
+		srec.ext = base + s->off;
+		srec.extLen = s->len;
+		rc.data.push_back(std::move(srec));
+	}
+	return true;
+}
+
+bool ESPSnapLoader::fill(MyGroup &grp, const ESPSnapNode &n)
+{
+	if (!n.isGroup || n.count > nnodes - pos) return false;
+	if (n.orig && (n.orig - 1 > src_len || n.origLen > src_len - (n.orig - 1))) return false;
+	
+	grp.grp = n.hdr.grp;
+	if (n.orig) grp.orig = src + (n.orig - 1);
+	
+	grp.data.reserve(n.count);
+	for (uint32_t k = 0; k < n.count; k++) {
+		const ESPSnapNode* c = next();
+		if (!c) return false;
+		
+		if (c->isGroup) {
+			MyGroup* g = new_group(data);
+			//header goes first: the owner link depends on it
+			g->grp = c->hdr.grp;
+			add_to_group(data,&grp,g);
+			if (!fill(*g,*c)) return false;
+		} else {
+			MyRecord* r = new_record(data);
+			add_to_group(data,&grp,r);
+			if (!fill(*r,*c)) return false;
+		}
+	}
+	return true;
+}
+
+bool read_esp_snapshot(MyESP &data, string const &src, string const &snap)
+{
+	struct stat sst, st;
+	size_t slen, len;
+	shared_ptr<const uint8_t> sm = map_file(snap,slen,sst);
+	if (!sm || slen < sizeof(ESPSnapHeader)) return false;
+	
+	//the key: same path, size and modification time
+	ESPSnapHeader hdr;
+	memcpy(&hdr,sm.get(),sizeof(hdr));
+	if (memcmp(hdr.magic,ESP_SNAP_MAGIC,sizeof(hdr.magic)) || hdr.version != ESP_SNAP_VERSION) return false;
+	if (hdr.nodeSize != sizeof(ESPSnapNode) || hdr.subSize != sizeof(ESPSnapSub)) return false;
+	if (hdr.pathLen != src.length() || sizeof(hdr) + hdr.pathLen > slen) return false;
+	if (memcmp(sm.get() + sizeof(hdr),src.data(),src.length())) return false;
+	
+	uint64_t off = sizeof(hdr) + hdr.pathLen + (8 - hdr.pathLen % 8) % 8;
+	if (hdr.nodes > (slen - off) / sizeof(ESPSnapNode)) return false;
+	uint64_t soff = off + hdr.nodes * sizeof(ESPSnapNode);
+	if (hdr.subs > (slen - soff) / sizeof(ESPSnapSub)) return false;
+	uint64_t boff = soff + hdr.subs * sizeof(ESPSnapSub);
+	if (hdr.blobLen != slen - boff) return false;
+	
+	shared_ptr<const uint8_t> sp = map_file(src,len,st);
+	if (!sp || (uint64_t)st.st_size != hdr.srcSize || st.st_mtim.tv_sec != hdr.srcMTime || st.st_mtim.tv_nsec != hdr.srcMTimeNs)
+		return false;
+	
+	clear_esp(data);
+	data.source = sp;
+	data.source_len = len;
+	data.source_dev = st.st_dev;
+	data.source_ino = st.st_ino;
+	data.snapshot = sm;
+	data.snapshot_len = slen;
+	
+	//nodes are about as big as their tables
+	size_t est = hdr.nodes * (max(sizeof(MyGroup),sizeof(MyRecord)) + sizeof(MyGroupRecord)) + hdr.subs * sizeof(MySubRecord);
+	data.arena = make_shared<MyArena>(max(est,(size_t)(1<<20)));
+	MyArena* arena = data.arena.get();
+	
+	ESPSnapLoader ld(data);
+	ld.nodes = (const ESPSnapNode*)(sm.get() + off);
+	ld.subs = (const ESPSnapSub*)(sm.get() + soff);
+	ld.blob = sm.get() + boff;
+	ld.src = sp.get();
+	ld.nnodes = hdr.nodes;
+	ld.nsubs = hdr.subs;
+	ld.blob_len = hdr.blobLen;
+	ld.src_len = len;
+	
+	bool ok = true;
+	for (uint32_t i = 0; ok && i < hdr.topRecs; i++) {
+		const ESPSnapNode* n = ld.next();
+		data.recs.emplace_back(MyRecord::allocator_type(arena));
+		ok = n && ld.fill(data.recs.back(),*n);
+	}
+	for (uint32_t i = 0; ok && i < hdr.topGrps; i++) {
+		const ESPSnapNode* n = ld.next();
+		data.grps.emplace_back(MyGroup::allocator_type(arena));
+		ok = n && ld.fill(data.grps.back(),*n);
+	}
+	
+	if (!ok || ld.pos != hdr.nodes) {
+		clear_esp(data);
+		return false;
+	}
+	touch_esp(data);
+	return true;
+}
+
+MyESP read_esp_cached(string const &src, string const &dir)
+{
+	MyESP res;
+	string snap = esp_snapshot_name(dir,src);
+	if (read_esp_snapshot(res,src,snap)) return res;
+	
+	//the key is taken before reading: if the file changes meanwhile, the snapshot just won't match
+	struct stat st;
+	if (stat(src.c_str(),&st)) return res;
+	FILE* f = fopen(src.c_str(),"rb");
+	if (!f) return res;
+	res = read_esp_mapped(f);
+	fclose(f);
+	
+	write_snapshot(res,src,snap,st);
+	return res;
+}
+
+#endif /* TES4LIB_USE_VFS */
+
+}; //TES4
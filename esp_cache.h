@@ -0,0 +1,98 @@
+/*
+ * TES4 data file library.
+ * (C) Dmitry 'MatrixS_Master' Solovyev, 2015-2019. All rights reserved.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights to
+ * use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies
+ * of the Software, and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED,
+ * INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A
+ * PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+ * HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+ * OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ *
+ */
+
+#ifndef ESP_CACHE_H_
+#define ESP_CACHE_H_
+
+#include <string>
+#include "esp_parser.h"
+
+namespace TES4 {
+
+#define ESP_SNAP_MAGIC "TES4SNAP"
+#define ESP_SNAP_VERSION 2
+
+/* Snapshot cache of parsed plugins.
+ * A snapshot is a flat image of the tree read by read_esp_mapped(): the node table (in depth-first order),
+ * the sub-record table and a blob with the inflated bodies of compressed records (laid out as they were
+ * inflated). Everything else (uncompressed payloads, original bodies for write_esp()) is referenced by
+ * offset in the source file, which is guaranteed to be unchanged by the key (path, size and mtime). So
+ * loading a snapshot is just mapping both files and building the nodes: nothing is parsed, copied or inflated. */
+struct ESPSnapHeader {
+	char magic[8];
+	uint32_t version;
+	uint32_t pathLen;	//source path follows the header (padded to 8 bytes), then the tables
+	uint32_t nodeSize;	//sizes of table entries (sanity check)
+	uint32_t subSize;
+	uint64_t srcSize;
+	int64_t srcMTime;
+	int64_t srcMTimeNs;
+	uint64_t nodes;
+	uint64_t subs;
+	uint64_t blobLen;
+	uint32_t topRecs;	//top-level records come first in the node table, then top-level groups
+	uint32_t topGrps;
+};
+
+struct ESPSnapNode {
+	uint32_t isGroup;
+	uint32_t count;		//children of a group (nodes right after it), sub-records of a record
+	uint64_t first;		//first sub-record of a record
+	uint64_t orig;		//offset of record's body or group's header in the source + 1 (0 = none)
+	uint32_t origLen;
+	union {
+		TES4Record rec;
+		TES4Group grp;
+	} hdr;
+};
+
+struct ESPSnapSub {
+	TES4SubRecord hdr;
+	uint16_t inBlob;	//payload is in the blob of the snapshot, rather than in the source
+	uint32_t kludgeSize;
+	uint32_t len;
+	uint64_t off;
+};
+
+#ifndef TES4LIB_USE_VFS
+//snapshot file name of the plugin inside the cache directory
+std::string esp_snapshot_name(std::string const &dir, std::string const &src);
+
+//saves the tree freshly read by read_esp_mapped() from the src file
+bool write_esp_snapshot(MyESP &data, std::string const &src, std::string const &snap);
+
+//loads the tree of src from its snapshot, if it's still valid (false otherwise)
+bool read_esp_snapshot(MyESP &data, std::string const &src, std::string const &snap);
+
+//read_esp_mapped() through the cache in dir: uses a valid snapshot, or reads the plugin and makes a new one
+MyESP read_esp_cached(std::string const &src, std::string const &dir);
+#endif
+
+//cache directory used by load_esp_filelist() (empty = don't cache, which is the default); unless the list
+//is loaded 'mapped', the parts of the plugins which are referenced by the snapshots are still copied
+void set_esp_cache_dir(std::string const &dir);
+std::string get_esp_cache_dir();
+
+}; //TES4
+
+#endif /* ESP_CACHE_H_ */
@@ -0,0 +1,265 @@
+/*
+ * TES4 data file library.
+ * (C) Dmitry 'MatrixS_Master' Solovyev, 2015-2019. All rights reserved.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights to
+ * use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies
+ * of the Software, and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED,
+ * INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A
+ * PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+ * HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+ * OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ *
+ */
+
+#include <algorithm>
+#include <ctype.h>
+#include "esp_index.h"
+#include "esp_thread.h"
+
+using namespace std;
+namespace TES4 {
+
+//FormID first, then load order; records of the same plugin keep their order (stable algorithms)
+static bool entry_less(const FormIDEntry &a, const FormIDEntry &b)
+{
+	return (a.fid != b.fid)? (a.fid < b.fid) : (a.plugid < b.plugid);
+}
+
+void FormIDIndex::collect(MyGroup &grp, short plugid, vector<FormIDEntry> &out)
+{
+	for (auto &&i : grp.data) {
+		if (i.isGroup)
+			collect(*(i.data.grp),plugid,out);
+		else {
+			FormIDEntry e;
+			e.fid = global_formid(i.data.rec->rec.formID,plugid);
+			e.plugid = plugid;
+			e.rec = i.data.rec;
+			out.push_back(e);
+		}
+	}
+}
+
+void FormIDIndex::build(MyESPEntry &plugin)
+{
+	ents.clear();
+	for (auto &&i : plugin.data.grps) collect(i,plugin.plugid,ents);
+	stable_sort(ents.begin(),ents.end(),entry_less);
+	ents.shrink_to_fit();
+}
+
+void FormIDIndex::build(list<MyESPEntry> &plugins, unsigned threads)
+{
+	vector<MyESPEntry*> todo;
+	for (auto &&i : plugins) todo.push_back(&i);
+	
+	vector<FormIDIndex> parts(todo.size());
+	parallel_for(todo.size(),threads,[&] (size_t n) { parts[n].build(*(todo[n])); });
+	
+	//merge neighbours pairwise, until there's only one left
+	while (parts.size() > 1) {
+		vector<FormIDIndex> next((parts.size() + 1) / 2);
+		parallel_for(next.size(),threads,[&] (size_t n) {
+			next[n] = std::move(parts[n*2]);
+			if (n*2 + 1 < parts.size()) next[n].merge(parts[n*2+1]);
+		});
+		parts.swap(next);
+	}
+	
+	ents.clear();
+	if (!parts.empty()) ents.swap(parts[0].ents);
+}
+
+void FormIDIndex::merge(const FormIDIndex &other)
+{
+	vector<FormIDEntry> res(ents.size() + other.ents.size());
+	std::merge(ents.begin(),ents.end(),other.ents.begin(),other.ents.end(),res.begin(),entry_less);
+	ents.swap(res);
+}
+
+void FormIDIndex::update(MyESPEntry &plugin)
+{
+	FormIDIndex part;
+	part.build(plugin);
+	ents.erase(remove_if(ents.begin(),ents.end(),[&] (const FormIDEntry &e) { return e.plugid == plugin.plugid; }),ents.end());
+	
+	//merge from the back, right in place (PluginIDs differ, so there are no ties)
+	size_t i = ents.size(), j = part.ents.size(), k = i + j;
+	ents.resize(k);
+	while (j) {
+		if (i && entry_less(part.ents[j-1],ents[i-1])) ents[--k] = ents[--i];
+		else ents[--k] = part.ents[--j];
+	}
+}
+
+pair<const FormIDEntry*,const FormIDEntry*> FormIDIndex::find(uint32_t fid) const
+{
+	FormIDEntry key;
+	key.fid = fid;
+	auto r = equal_range(ents.begin(),ents.end(),key,[] (const FormIDEntry &a, const FormIDEntry &b) { return a.fid < b.fid; });
+	if (r.first == r.second) return pair<const FormIDEntry*,const FormIDEntry*>(NULL,NULL);
+	return pair<const FormIDEntry*,const FormIDEntry*>(&(*r.first),&(*r.first) + (r.second - r.first));
+}
+
+MyRecord* FormIDIndex::get(uint32_t fid) const
+{
+	auto r = find(fid);
+	return (r.first == r.second)? NULL : (r.second - 1)->rec;
+}
+
+MyRecord* FormIDIndex::get(uint32_t fid, short plugid) const
+{
+	auto r = find(fid);
+	for (auto i = r.first; i != r.second; ++i)
+		if (i->plugid == plugid) return i->rec;
+	return NULL;
+}
+
+static void fold_name(string_view in, vector<char> &to)
+{
+	for (auto c : in) to.push_back(toupper((unsigned char)c));
+}
+
+void EditorIDIndex::clear()
+{
+	pool.clear();
+	ents.clear();
+}
+
+void EditorIDIndex::build(const FormIDIndex &fids)
+{
+	clear();
+	
+	//fold the names into a scratch pool first
+	vector<char> tmp;
+	auto &src = fids.getEntries();
+	for (size_t i = 0; i < src.size(); i++) {
+		if (i + 1 < src.size() && src[i+1].fid == src[i].fid) continue; //overridden later
+		
+		string_view edid = get_subfield_view(src[i].rec,FCC_EDID);
+		if (edid.empty()) continue;
+		
+		EditorIDEntry e;
+		e.name = tmp.size();
+		e.len = edid.size();
+		e.fid = src[i].fid;
+		e.plugid = src[i].plugid;
+		e.rec = src[i].rec;
+		fold_name(edid,tmp);
+		ents.push_back(e);
+	}
+	
+	auto nm = [&] (const EditorIDEntry &e) { return string_view(&(tmp[e.name]),e.len); };
+	stable_sort(ents.begin(),ents.end(),[&] (const EditorIDEntry &a, const EditorIDEntry &b) {
+		int c = nm(a).compare(nm(b));
+		return c? (c < 0) : (a.plugid < b.plugid);
+	});
+	
+	//then intern them: equal names are neighbours now, so each one goes to the pool once
+	pool.reserve(tmp.size());
+	for (size_t i = 0; i < ents.size(); i++) {
+		if (i && nm(ents[i]) == string_view(&(pool[ents[i-1].name]),ents[i-1].len)) {
+			ents[i].name = ents[i-1].name;
+			continue;
+		}
+		uint32_t off = pool.size();
+		pool.insert(pool.end(),tmp.begin()+ents[i].name,tmp.begin()+ents[i].name+ents[i].len);
+		ents[i].name = off;
+	}
+	pool.shrink_to_fit();
+	ents.shrink_to_fit();
+}
+
+//same order as build() leaves the entries in
+bool EditorIDIndex::less(const EditorIDEntry &a, const EditorIDEntry &b) const
+{
+	int c = getName(a).compare(getName(b));
+	return c? (c < 0) : (a.plugid < b.plugid);
+}
+
+void EditorIDIndex::update(const FormIDIndex &fids, short plugid)
+{
+	//FormIDs the plugin had before (its records are gone) and has now: only their winners may have changed
+	vector<uint32_t> todo;
+	for (auto &&i : ents)
+		if (i.plugid == plugid) todo.push_back(i.fid);
+	for (auto &&i : fids.getEntries())
+		if (i.plugid == plugid) todo.push_back(i.fid);
+	sort(todo.begin(),todo.end());
+	todo.erase(unique(todo.begin(),todo.end()),todo.end());
+	
+	ents.erase(remove_if(ents.begin(),ents.end(),[&] (const EditorIDEntry &e) {
+		return binary_search(todo.begin(),todo.end(),e.fid); }),ents.end());
+	
+	//the new entries go to the end of the pool, sharing the names which are there already
+	vector<EditorIDEntry> part;
+	for (auto fid : todo) {
+		auto r = fids.find(fid);
+		if (r.first == r.second) continue;
+		const FormIDEntry &w = *(r.second - 1);
+		string_view edid = get_subfield_view(w.rec,FCC_EDID);
+		if (edid.empty()) continue;
+		
+		EditorIDEntry e;
+		e.name = pool.size();
+		e.len = edid.size();
+		e.fid = fid;
+		e.plugid = w.plugid;
+		e.rec = w.rec;
+		fold_name(edid,pool);
+		
+		auto it = lower_bound(ents.begin(),ents.end(),e,[&] (const EditorIDEntry &a, const EditorIDEntry &b) { return less(a,b); });
+		const EditorIDEntry* same = NULL;
+		if (it != ents.end() && getName(*it) == getName(e)) same = &(*it);
+		else if (it != ents.begin() && getName(*(it-1)) == getName(e)) same = &(*(it-1));
+		if (same) {
+			pool.resize(e.name);
+			e.name = same->name;
+		}
+		part.push_back(e);
+	}
+	stable_sort(part.begin(),part.end(),[&] (const EditorIDEntry &a, const EditorIDEntry &b) { return less(a,b); });
+	
+	//merge from the back, right in place (ties keep the old entries first)
+	size_t i = ents.size(), j = part.size(), k = i + j;
+	ents.resize(k);
+	while (j) {
+		if (i && less(part[j-1],ents[i-1])) ents[--k] = ents[--i];
+		else ents[--k] = part[--j];
+	}
+}
+
+pair<const EditorIDEntry*,const EditorIDEntry*> EditorIDIndex::range(string_view key, bool prefix) const
+{
+	vector<char> buf;
+	fold_name(key,buf);
+	string_view k(buf.data(),buf.size());
+	
+	//names are compared as a whole, or only by their first k.size() chars
+	auto lo = lower_bound(ents.begin(),ents.end(),k,[&] (const EditorIDEntry &e, string_view v) {
+		return getName(e) < v; });
+	auto hi = upper_bound(lo,ents.end(),k,[&] (string_view v, const EditorIDEntry &e) {
+		string_view n = getName(e);
+		return v < (prefix? n.substr(0,v.size()) : n); });
+	
+	if (lo == hi) return pair<const EditorIDEntry*,const EditorIDEntry*>(NULL,NULL);
+	return pair<const EditorIDEntry*,const EditorIDEntry*>(&(*lo),&(*lo) + (hi - lo));
+}
+
+MyRecord* EditorIDIndex::get(string_view edid) const
+{
+	auto r = find(edid);
+	return (r.first == r.second)? NULL : (r.second - 1)->rec;
+}
+
+}; //TES4
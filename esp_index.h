@@ -0,0 +1,125 @@
+/*
+ * TES4 data file library.
+ * (C) Dmitry 'MatrixS_Master' Solovyev, 2015-2019. All rights reserved.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights to
+ * use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies
+ * of the Software, and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED,
+ * INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A
+ * PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+ * HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+ * OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ *
+ */
+
+#ifndef ESP_INDEX_H_
+#define ESP_INDEX_H_
+
+#include <vector>
+#include <list>
+#include <utility>
+#include <string_view>
+#include "esp_parser.h"
+#include "esp_utils.h"
+
+namespace TES4 {
+
+struct FormIDEntry {
+	uint32_t fid;	//FormID with the plugin's load order byte (see global_formid())
+	short plugid;
+	MyRecord* rec;
+};
+
+/* FormID lookup table for one plugin or a whole load order (replaces FORMIDS).
+ * It's a flat array sorted by FormID, then by load order, so all the overrides of a record
+ * sit next to each other, and the last one of them is the winner. */
+class FormIDIndex {
+private:
+	std::vector<FormIDEntry> ents;
+
+	static void collect(MyGroup &grp, short plugid, std::vector<FormIDEntry> &out);
+
+public:
+	FormIDIndex() {}
+	FormIDIndex(const FormIDIndex&) = default;
+	FormIDIndex(FormIDIndex&&) = default;
+	FormIDIndex& operator=(const FormIDIndex&) = default;
+	FormIDIndex& operator=(FormIDIndex&&) = default;
+	virtual ~FormIDIndex() {}
+
+	void clear()									{ ents.clear(); }
+	size_t getNumEntries() const					{ return ents.size(); }
+	size_t getMemoryUsage() const					{ return ents.capacity() * sizeof(FormIDEntry); }
+
+	//indexes one plugin (replacing whatever was here)
+	void build(MyESPEntry &plugin);
+	//indexes the whole load order: each plugin on its own thread, then merged (0 = all cores)
+	void build(std::list<MyESPEntry> &plugins, unsigned threads = 0);
+	//adds all the entries of another index
+	void merge(const FormIDIndex &other);
+	//replaces the entries of a plugin which was re-read (with the same PluginID)
+	void update(MyESPEntry &plugin);
+	const std::vector<FormIDEntry>& getEntries() const	{ return ents; }
+
+	//all the records with this FormID in load order, as [first,last) range
+	std::pair<const FormIDEntry*,const FormIDEntry*> find(uint32_t fid) const;
+	//the winning override (or NULL)
+	MyRecord* get(uint32_t fid) const;
+	//the version of the record from given plugin (or NULL)
+	MyRecord* get(uint32_t fid, short plugid) const;
+};
+
+struct EditorIDEntry {
+	uint32_t name;	//offset of the (folded) name in the pool
+	uint32_t len;
+	uint32_t fid;	//global FormID of the record
+	short plugid;
+	MyRecord* rec;
+};
+
+/* Case-insensitive EditorID lookup for the winning records of a load order. Names are
+ * upper-cased once, and each one is stored once in a shared pool. Entries are sorted by name
+ * (then by load order), so both exact and prefix matches are contiguous ranges. */
+class EditorIDIndex {
+private:
+	std::vector<char> pool;
+	std::vector<EditorIDEntry> ents;
+
+	std::pair<const EditorIDEntry*,const EditorIDEntry*> range(std::string_view key, bool prefix) const;
+	bool less(const EditorIDEntry &a, const EditorIDEntry &b) const;
+
+public:
+	EditorIDIndex() {}
+	virtual ~EditorIDIndex() {}
+
+	void clear();
+	size_t getNumEntries() const					{ return ents.size(); }
+	size_t getMemoryUsage() const					{ return pool.capacity() + ents.capacity() * sizeof(EditorIDEntry); }
+	std::string_view getName(const EditorIDEntry &e) const	{ return std::string_view(&(pool[e.name]),e.len); }
+
+	//indexes EDIDs of the last override of every FormID (so renames by later plugins win)
+	void build(const FormIDIndex &fids);
+	/* replaces the entries of a plugin which was re-read (with the same PluginID), after fids was updated;
+	 * only the FormIDs of the plugin are looked up again (names dropped stay in the pool until the next build()) */
+	void update(const FormIDIndex &fids, short plugid);
+
+	//all the records with this EDID, in load order
+	std::pair<const EditorIDEntry*,const EditorIDEntry*> find(std::string_view edid) const	{ return range(edid,false); }
+	//all the records with EDIDs starting with this
+	std::pair<const EditorIDEntry*,const EditorIDEntry*> findPrefix(std::string_view prefix) const	{ return range(prefix,true); }
+	//the last loaded record with this EDID (or NULL)
+	MyRecord* get(std::string_view edid) const;
+};
+
+}; //TES4
+
+#endif /* ESP_INDEX_H_ */
@@ -30,19 +30,89 @@
 #include <list>
 #include <algorithm>
 #include <functional>
+#include <thread>
+#include <mutex>
+#include <chrono>
 #include "esp_list.h"
+#include "esp_cache.h"
+#include "esp_resident.h"
+#include "esp_thread.h"
 #include "libtes4vfs.h"
 
 #ifndef TES4LIB_USE_VFS
 #include <sys/stat.h>
 #include <unistd.h>
 #include <utime.h>
+#include <poll.h>
+#ifdef __linux__
+#include <sys/inotify.h>
+#endif
 #endif
 
 using namespace std;
 namespace TES4 {
 
-int load_esp_filelist(string const &listfn, string const &gamedir, esplist &files, VFS* vfs, VFSProgressCb prog_cb)
+//whether the file is primary master (0), secondary master (1) or regular plugin (2)
+static int esp_class(ESPHeaderEntry const &e)
+{
+	if (equ_ignorecase(e.name,"Oblivion.esm")) return 0;
+	//the game goes by the header flag, .esm extension is just a convention
+	if (e.hdr.isMaster()) return 1;
+	if (e.name.size() >= 4 && equ_ignorecase(e.name.substr(e.name.size()-4),".esm")) return 1;
+	return 2;
+}
+
+/* Loads the entries on 'threads' threads (0 = all cores); prog_cb is called from them, one call at a time.
+ * Unless 'mapped' is set, the plugins are copied, so they can be rewritten while the list is alive. */
+static int load_entries(vector<MyESPEntry*> const &todo, VFS* vfs, unsigned threads, VFSProgressCb prog_cb, size_t total, bool mapped)
+{
+	int files_total = 0;
+	mutex mtx; //console and progress callback
+	//with a memory budget installed, compressed records are left packed for it, and copies leave the bodies in the files (see esp_resident.h)
+	ESPOptions opts;
+	if (get_esp_residency()) {
+		opts.zip = ESP_ZIP_LAZY;
+		opts.onDemand = !mapped;
+	}
+#ifdef TES4LIB_USE_VFS
+	threads = 1; //VFS isn't known to be thread-safe, and the files are read through it, not just opened
+#else
+	//snapshots of unchanged plugins are used instead of parsing them (but they would be copied as a whole for an on-demand list)
+	string cache = opts.onDemand? string() : get_esp_cache_dir();
+#endif
+	parallel_for(todo.size(),threads,[&] (size_t n) {
+		MyESPEntry &i = *(todo[n]);
+		MFILE ff = NULL; //current file handle
+		{
+			lock_guard<mutex> lk(mtx);
+			cout << "DEBUG: Loading " << i.name << endl;
+			fflush(stdout);
+		}
+#ifndef TES4LIB_USE_VFS
+		if (cache.empty())
+#endif
+			ff = MFOPEN(i.name.c_str(),"rb");
+#ifndef TES4LIB_USE_VFS
+		if (!cache.empty()) {
+			i.data = read_esp_cached(i.name,cache);
+			if (!mapped) detach_esp(i.data); //(the snapshot itself is never rewritten in place)
+		} else
+#endif
+		if (ff) { //(it may be gone already, if it's being replaced under a watcher)
+			i.data = mapped? read_esp_mapped(ff,opts) : read_esp(ff,opts);
+			MFCLOSE(ff);
+		}
+
+		lock_guard<mutex> lk(mtx);
+		if (!i.data.complete) cout << "DEBUG: " << i.name << " is truncated or broken, loaded up to the damage only" << endl;
+		files_total++;
+		if (prog_cb) prog_cb(files_total,total);
+	});
+
+	return files_total;
+}
+
+int load_esp_filelist(string const &listfn, string const &gamedir, esplist &files, VFS* vfs, VFSProgressCb prog_cb, unsigned threads, bool mapped)
 {
 	if (listfn.empty()) return 0;
 	vector<string> flist;
@@ -65,14 +135,14 @@ int load_esp_filelist(string const &listfn, string const &gamedir, esplist &file
 	MFCLOSE(ff);
 
 	//Now we can actually LOAD the list contents
-	return load_esp_filelist(flist,gamedir,files,vfs,prog_cb);
+	return load_esp_filelist(flist,gamedir,files,vfs,prog_cb,threads,mapped);
 }
 
-int load_esp_filelist(vector<string> const &flist, string gamedir, esplist &files, VFS* vfs, VFSProgressCb prog_cb)
+int scan_esp_filelist(vector<string> const &flist, string gamedir, vector<ESPHeaderEntry> &out, VFS* vfs, unsigned threads)
 {
 	//Our basic names holders
-	int files_total = 0; //total number of files loaded
-	multimap<long int,MyESPEntry> esm_map,esp_map; //they would be sorted by modification timestamp
+	vector<ESPHeaderEntry> all; //in list order
+	multimap<long int,ESPHeaderEntry> esm_map,esp_map; //they would be sorted by modification timestamp
 
 #ifndef TES4LIB_USE_VFS
 	struct stat st; //file stat
@@ -93,58 +163,115 @@ int load_esp_filelist(vector<string> const &flist, string gamedir, esplist &file
 			cout << "\tNot found!" << endl;
 
 		} else {
-			MyESPEntry rec;
+			ESPHeaderEntry rec;
 			rec.name = buf;
+			rec.mtime = st.st_mtim.tv_sec;
+			rec.size = st.st_size;
 //			cout << "\tmtime = " << st.st_mtim.tv_sec << endl;
-
-			//check whether the file is primary master, secondary master or regular plugin
-			if (equ_ignorecase(rec.name,"Oblivion.esm"))
-				files.push_back(rec); //primary master
-			else if (equ_ignorecase(rec.name.substr(rec.name.size()-4),".esm"))
-				esm_map.insert(pair<long int,MyESPEntry>(st.st_mtim.tv_sec,rec)); //secondary master
-			else
-				esp_map.insert(pair<long int,MyESPEntry>(st.st_mtim.tv_sec,rec)); //regular plugin
+			all.push_back(std::move(rec));
 		}
 #else
-		MyESPEntry rec;
+		ESPHeaderEntry rec;
 		rec.name = buf;
-		//check whether the file is primary master, secondary master or regular plugin
-		if (equ_ignorecase(rec.name,"Oblivion.esm"))
-			files.push_back(rec); //primary master
-		else if (equ_ignorecase(rec.name.substr(rec.name.size()-4),".esm"))
-			esm_map.insert(pair<long int,MyESPEntry>(pdate++,rec)); //secondary master
-		else
-			esp_map.insert(pair<long int,MyESPEntry>(pdate++,rec)); //regular plugin
+		rec.mtime = pdate++;
+		all.push_back(std::move(rec));
 #endif
 	}
 
-	bool basepresent = !files.empty(); //if Oblivion.esm is here, don't pre-increment PlugID
-	short plugid = basepresent? 0:1; //PluginID byte
+	//Read the headers: only the first record of each file is touched, so it's mostly opening them
+#ifdef TES4LIB_USE_VFS
+	threads = 1; //VFS isn't known to be thread-safe
+#endif
+	parallel_for(all.size(),threads,[&] (size_t n) {
+		ESPHeaderEntry &i = all[n];
+		MFILE ff = MFOPEN(i.name.c_str(),"rb"); //current file handle
+		if (!ff) return;
+		i.valid = read_esp_header(ff,i.hdr) > 0;
+		MFCLOSE(ff);
+	});
+
+	//check whether the file is primary master, secondary master or regular plugin
+	out.clear();
+	for (auto &&i : all) {
+		int cls = esp_class(i);
+		if (!cls)
+			out.push_back(std::move(i)); //primary master
+		else if (cls == 1)
+			esm_map.insert(pair<long int,ESPHeaderEntry>(i.mtime,std::move(i))); //secondary master
+		else
+			esp_map.insert(pair<long int,ESPHeaderEntry>(i.mtime,std::move(i))); //regular plugin
+	}
 
 	//Compile all maps and stuff into one CORRECT load order list
-	for (auto &&i : files) cout << i.name << endl;
-	for (auto &&i : esm_map) files.push_back(i.second);
-	for (auto &&i : esp_map) files.push_back(i.second);
+	for (auto &&i : esm_map) out.push_back(std::move(i.second));
+	for (auto &&i : esp_map) out.push_back(std::move(i.second));
 
-	//Discard temporary maps
-	esm_map.clear();
-	esp_map.clear();
+	return out.size();
+}
 
-	//Start loading process
-	MFILE ff; //current file handle
+int load_esp_filelist(vector<string> const &flist, string gamedir, esplist &files, VFS* vfs, VFSProgressCb prog_cb, unsigned threads, bool mapped)
+{
+	vector<ESPHeaderEntry> order;
+	scan_esp_filelist(flist,gamedir,order,vfs,threads);
+
+	bool basepresent = !order.empty() && !esp_class(order[0]); //if Oblivion.esm is here, don't pre-increment PlugID
+	short plugid = basepresent? 0:1; //PluginID byte
+
+	for (auto &&i : order) {
+		if (!esp_class(i)) cout << i.name << endl;
+		MyESPEntry rec;
+		rec.name = i.name;
+		rec.header = std::move(i.hdr);
+		files.push_back(std::move(rec));
+	}
+
+	//Start loading process: PluginIDs follow the load order, but plugins themselves are independent
+	vector<MyESPEntry*> todo;
 	for (auto &&i : files) {
-		cout << "DEBUG: Loading " << i.name << endl;
-		fflush(stdout);
-		ff = MFOPEN(i.name.c_str(),"rb");
-		assert(ff);
-		i.data = read_esp(ff);
-		MFCLOSE(ff);
 		i.plugid = plugid++;
-		files_total++;
-		if (prog_cb) prog_cb(files_total,files.size());
+		todo.push_back(&i);
 	}
 
-	return files_total;
+	return load_entries(todo,vfs,threads,prog_cb,files.size(),mapped);
+}
+
+int check_esp_masters(vector<ESPHeaderEntry> const &order, vector<string> &problems)
+{
+	//masters are referred to by file name only
+	unordered_map<string,size_t> pos;
+	for (size_t i = 0; i < order.size(); i++) {
+		string fn = order[i].name.substr(order[i].name.rfind('/')+1);
+		transform(fn.begin(),fn.end(),fn.begin(),::tolower);
+		pos[fn] = i;
+	}
+
+	size_t before = problems.size();
+	for (size_t i = 0; i < order.size(); i++) {
+		const ESPHeaderEntry &e = order[i];
+		if (!e.valid) {
+			problems.push_back(e.name + ": no valid TES4 header");
+			continue;
+		}
+		for (size_t k = 0; k < e.hdr.masters.size(); k++) {
+			string fn = e.hdr.masters[k];
+			transform(fn.begin(),fn.end(),fn.begin(),::tolower);
+			auto p = pos.find(fn);
+			if (p == pos.end())
+				problems.push_back(e.name + ": missing master " + e.hdr.masters[k]);
+			else if (p->second > i)
+				problems.push_back(e.name + ": loaded before its master " + e.hdr.masters[k]);
+			else if (e.hdr.masterSizes[k] && order[p->second].size && e.hdr.masterSizes[k] != order[p->second].size)
+				problems.push_back(e.name + ": master " + e.hdr.masters[k] + " has changed since");
+		}
+	}
+	return problems.size() - before;
+}
+
+int check_esp_masters(vector<string> const &flist, string const &gamedir, vector<string> &problems, VFS* vfs, unsigned threads)
+{
+	vector<ESPHeaderEntry> order;
+	scan_esp_filelist(flist,gamedir,order,vfs,threads);
+	return check_esp_masters(order,problems);
 }
 
 void unload_esp_filelist(esplist &files)
@@ -153,4 +280,184 @@ void unload_esp_filelist(esplist &files)
 	files.clear();
 }
 
+#ifndef TES4LIB_USE_VFS
+
+ESPWatcher::ESPWatcher(esplist &list, vector<string> const &names, string dir, unsigned thr) :
+	files(list), flist(names), gamedir(dir), ifd(-1), threads(thr)
+{
+	if (!dir.empty() && dir[dir.length()-1] != '/') dir += '/';
+	set<string> dset;
+	for (auto &&i : flist) {
+		string fn = dir + i;
+		state[fn] = probe(fn);
+		dset.insert(fn.substr(0,fn.rfind('/')+1));
+	}
+
+#ifdef __linux__
+	//plugins are usually saved either in place, or by renaming a temporary file over them
+	ifd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+	for (auto &&d : dset) {
+		if (ifd < 0) break;
+		int wd = inotify_add_watch(ifd,d.empty()? "." : d.c_str(),IN_CLOSE_WRITE | IN_MOVED_TO | IN_MOVED_FROM | IN_DELETE | IN_ATTRIB);
+		if (wd < 0) {
+			//can't watch everything, so fall back to polling
+			close(ifd);
+			ifd = -1;
+			dirs.clear();
+		} else
+			dirs[wd] = d;
+	}
+#endif
+}
+
+ESPWatcher::~ESPWatcher()
+{
+	if (ifd >= 0) close(ifd);
+}
+
+ESPFileState ESPWatcher::probe(string const &fn)
+{
+	ESPFileState res;
+	struct stat st;
+	if (!stat(fn.c_str(),&st)) {
+		res.present = true;
+		res.size = st.st_size;
+		res.mtime = st.st_mtim.tv_sec;
+		res.mtime_ns = st.st_mtim.tv_nsec;
+	}
+	return res;
+}
+
+//gathers names of the files which might have changed
+bool ESPWatcher::collect(int timeout, set<string> &cand)
+{
+	if (ifd < 0) {
+		//no notifications: look at every plugin, until something changes or time is out
+		auto end = chrono::steady_clock::now() + chrono::milliseconds(max(timeout,0));
+		for (;;) {
+			for (auto &&i : state)
+				if (probe(i.first) != i.second) cand.insert(i.first);
+			if (!cand.empty() || chrono::steady_clock::now() >= end) break;
+			this_thread::sleep_for(chrono::milliseconds(ESP_WATCH_POLL_MS));
+		}
+		return !cand.empty();
+	}
+
+#ifdef __linux__
+	struct pollfd pfd = { ifd, POLLIN, 0 };
+	if (poll(&pfd,1,timeout) < 1) return false;
+
+	alignas(struct inotify_event) char buf[4096];
+	bool overflow = false;
+	ssize_t len;
+	while ((len = read(ifd,buf,sizeof(buf))) > 0) {
+		for (char* p = buf; p < buf + len;) {
+			struct inotify_event* ev = (struct inotify_event*)p;
+			auto d = dirs.find(ev->wd);
+			if (ev->mask & IN_Q_OVERFLOW) overflow = true;
+			else if (ev->len && d != dirs.end()) cand.insert(d->second + ev->name);
+			p += sizeof(struct inotify_event) + ev->len;
+		}
+	}
+
+	//some events were lost, so everything has to be checked
+	if (overflow)
+		for (auto &&i : state) cand.insert(i.first);
+#endif
+	return !cand.empty();
+}
+
+/* Recomputes the load order the same way load_esp_filelist() does (by scanning the headers). Entries are
+ * just relinked, new ones are added to the changed set, and the ones gone are unloaded.
+ * Returns true if PluginIDs were shifted. */
+bool ESPWatcher::reorder(set<string> &changed)
+{
+	vector<ESPHeaderEntry> order;
+	scan_esp_filelist(flist,gamedir,order,NULL,threads);
+
+	esplist old;
+	old.swap(files);
+	map<string,esplist::iterator> had;
+	for (auto i = old.begin(); i != old.end(); ++i) had[i->name] = i;
+
+	bool shifted = false;
+	short plugid = (!order.empty() && !esp_class(order[0]))? 0:1;
+	for (auto &&k : order) {
+		const string &fn = k.name;
+		auto h = had.find(fn);
+		if (h != had.end()) {
+			files.splice(files.end(),old,h->second);
+			had.erase(h);
+			if (files.back().plugid != plugid) {
+				shifted = true;
+				invalidate_indices(files.back()); //its FormIDs are global ones
+			}
+		} else {
+			files.emplace_back();
+			files.back().name = fn;
+			changed.insert(fn);
+		}
+		files.back().header = std::move(k.hdr);
+		files.back().plugid = plugid++;
+	}
+
+	if (!old.empty()) shifted = true;
+	unload_esp_filelist(old);
+	return shifted;
+}
+
+int ESPWatcher::update(int timeout)
+{
+	set<string> cand;
+	if (!collect(timeout,cand)) return 0;
+
+	set<string> changed;
+	bool moved = false;
+	for (auto &&fn : cand) {
+		auto it = state.find(fn);
+		if (it == state.end()) continue;
+		ESPFileState now = probe(fn);
+		if (now == it->second) continue;
+
+		//only modification time (and presence) affects the order
+		if (now.present != it->second.present || now.mtime != it->second.mtime) moved = true;
+		it->second = now;
+		if (now.present) changed.insert(fn);
+	}
+	if (changed.empty() && !moved) return 0;
+
+	//a plugin which became a master (or stopped being one) moves as well
+	for (auto &&i : files) {
+		if (moved || !changed.count(i.name)) continue;
+		MyESPHeader hdr;
+		FILE* ff = fopen(i.name.c_str(),"rb");
+		if (ff) {
+			read_esp_header(ff,hdr);
+			fclose(ff);
+		}
+		if (hdr.isMaster() != i.header.isMaster()) moved = true;
+		i.header = std::move(hdr);
+	}
+
+	bool shifted = moved && reorder(changed);
+
+	vector<MyESPEntry*> todo;
+	for (auto &&i : files)
+		if (changed.count(i.name)) todo.push_back(&i);
+	load_entries(todo,NULL,threads,0,todo.size(),false); //(copies, see the class description)
+
+	for (auto &&i : fidxs) {
+		if (shifted) i->build(files,threads);
+		else for (auto &&j : todo) i->update(*j);
+	}
+	for (auto &&i : edidxs) {
+		if (shifted) i.first->build(*(i.second));
+		else for (auto &&j : todo) i.first->update(*(i.second),j->plugid);
+	}
+
+	return todo.size();
+}
+
+#endif /* TES4LIB_USE_VFS */
+
 }; //TES4
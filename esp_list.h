@@ -26,8 +26,12 @@
 
 #include "esp_parser.h"
 #include "esp_utils.h"
+#include "esp_index.h"
 #include "VFS.h"
 
+#include <map>
+#include <set>
+
 #ifdef TES4LIB_USE_VFS
 #include "vfshelper.h"
 #endif
@@ -36,10 +40,84 @@ namespace TES4 {
 
 typedef std::list<MyESPEntry> esplist; //that would contain all plugins in CORRECT order (as in game)
 
-int load_esp_filelist(std::string const &listfn, std::string const &gamedir, esplist &files, VFS* vfs = NULL, VFSProgressCb prog_cb = 0);
-int load_esp_filelist(std::vector<std::string> const &flist, std::string gamedir, esplist &files, VFS* vfs = NULL, VFSProgressCb prog_cb = 0);
+struct ESPHeaderEntry {
+	std::string name;	//full path
+	MyESPHeader hdr;
+	bool valid = false;	//the header was read
+	long int mtime = 0;	//what the load order is sorted by
+	uint64_t size = 0;
+};
+
+//reads the headers of the plugins (on 'threads' threads, one with VFS), and puts them in load order; masters are told by the header flag
+int scan_esp_filelist(std::vector<std::string> const &flist, std::string gamedir, std::vector<ESPHeaderEntry> &out, VFS* vfs = NULL, unsigned threads = 0);
+//checks that the masters of every plugin are there and go before it; returns the number of problems found (described in 'problems')
+int check_esp_masters(std::vector<ESPHeaderEntry> const &order, std::vector<std::string> &problems);
+int check_esp_masters(std::vector<std::string> const &flist, std::string const &gamedir, std::vector<std::string> &problems, VFS* vfs = NULL, unsigned threads = 0);
+
+/* Plugins are loaded on 'threads' threads (0 = all cores; always one with VFS); prog_cb is called from them,
+ * one call at a time. They are copied, unless 'mapped' is set: then they are mapped (see read_esp_mapped()),
+ * and must not be rewritten until the list is unloaded (or the entry is detached, see detach_esp()).
+ * Compressed records are inflated while loading (ESP_ZIP_EAGER), unless a residency manager is installed
+ * (see esp_resident.h): then they are left packed (ESP_ZIP_LAZY) for it to take care of, and the bodies
+ * of the others are left in the files of a copied list (ESPOptions::onDemand; the snapshot cache isn't
+ * used for it then). A truncated or malformed plugin is loaded up to the damage (see MyESP::complete). */
+int load_esp_filelist(std::string const &listfn, std::string const &gamedir, esplist &files, VFS* vfs = NULL, VFSProgressCb prog_cb = 0, unsigned threads = 0, bool mapped = false);
+int load_esp_filelist(std::vector<std::string> const &flist, std::string gamedir, esplist &files, VFS* vfs = NULL, VFSProgressCb prog_cb = 0, unsigned threads = 0, bool mapped = false);
 void unload_esp_filelist(esplist &files);
 
+#ifndef TES4LIB_USE_VFS
+#define ESP_WATCH_POLL_MS 250 //check interval of ESPWatcher::update() without inotify
+
+struct ESPFileState {
+	bool present = false;
+	int64_t size = 0;
+	int64_t mtime = 0;
+	int64_t mtime_ns = 0;
+
+	bool operator==(const ESPFileState &o) const	{ return present == o.present && size == o.size && mtime == o.mtime && mtime_ns == o.mtime_ns; }
+	bool operator!=(const ESPFileState &o) const	{ return !(*this == o); }
+};
+
+/* Keeps a loaded list in sync with the game directory. Only changed plugins are re-read, the load order
+ * is recomputed only when modification times or master flags move (or plugins come and go), and registered
+ * indices are updated in place. Changes are reported by inotify (on Linux), otherwise update() looks at
+ * the stats of every plugin. Create the watcher before loading the list with the same arguments, so a change
+ * made in between would be picked up by the first update(). The plugins are rewritten under the list, so it
+ * has to own their contents: don't load it 'mapped' (plugins re-read by update() are always copied). With
+ * a residency manager installed, unloaded records of a plugin rewritten in place can't be read until update()
+ * re-reads it (see ESPOptions::onDemand); ones replaced by renaming are still read from the old file. */
+class ESPWatcher {
+private:
+	esplist &files;
+	std::vector<std::string> flist;					//as given to load_esp_filelist()
+	std::string gamedir;
+	std::map<std::string,ESPFileState> state;		//as of the last update
+	std::map<int,std::string> dirs;					//inotify watches
+	int ifd;
+	unsigned threads;
+	std::vector<FormIDIndex*> fidxs;
+	std::vector<std::pair<EditorIDIndex*,const FormIDIndex*>> edidxs;
+
+	static ESPFileState probe(std::string const &fn);
+	bool collect(int timeout, std::set<std::string> &cand);
+	bool reorder(std::set<std::string> &changed);
+
+public:
+	ESPWatcher(esplist &list, std::vector<std::string> const &flist, std::string gamedir, unsigned threads = 0);
+	ESPWatcher(const ESPWatcher&) = delete;
+	ESPWatcher& operator=(const ESPWatcher&) = delete;
+	virtual ~ESPWatcher();
+
+	bool isNotify() const											{ return ifd >= 0; }
+	//indices of the list to be kept up to date (EditorID ones follow their FormID index, which has to be added too)
+	void addIndex(FormIDIndex* idx)									{ fidxs.push_back(idx); }
+	void addIndex(EditorIDIndex* idx, const FormIDIndex* from)		{ edidxs.push_back(std::make_pair(idx,from)); }
+
+	//waits up to timeout ms for changes and applies them; returns the number of plugins re-read
+	int update(int timeout = 0);
+};
+#endif
+
 }; //TES4
 
 #endif /* ESP_LIST_H_ */
@@ -21,18 +21,27 @@
  *
  */
 
+#include <thread>
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
+#include <deque>
+#include <algorithm>
 #include "esp_parser.h"
+#include "zip_codec.h"
+#include "esp_resident.h"
+#include "esp_thread.h"
 #include "libtes4vfs.h"
 
+#ifndef TES4LIB_USE_VFS
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#endif
+
 using namespace std;
 namespace TES4 {
 
-/* WARNING:
- * This code is still unfinished. There are at least two known bugs:
- * 1) If compressed data length > source data length (fool's compression), compression will fail.
- * 2) Bethesda's 64K kludge is implemented for reading only
- * */
-
 #if DEBUG_PARSE || DEBUG_DUMP
 static void print4(void* ptr)
 {
@@ -42,101 +51,575 @@ static void print4(void* ptr)
 }
 #endif
 
-int extract_zip_subrecords(vector<MySubRecord>* to, MFILE from, int to_read, unsigned fin_len)
-{
-	unsigned char* rdbuf = new unsigned char[to_read];
-	assert((int)MFREAD(rdbuf,1,to_read,from) == to_read);
+#define READ_BLOCK_SIZE (1 << 20)
+#define WRITE_BLOCK_SIZE (1 << 20)
+
+/* Input source of the parser: either a regular stream or a memory block (mapped file).
+ * Streams are read in large blocks, and headers are parsed straight from the buffer.
+ * For memory blocks sub-record payloads aren't copied, but referenced in-place. */
+struct ESPReader {
+	MFILE fd = NULL;
+	const uint8_t* mem = NULL;
+	size_t len = 0;
+	size_t pos = 0;
+	bool transient = false; //memory block won't outlive the tree, so payloads must be copied
+	const ESPSource* file = NULL; //uncompressed bodies are left there instead (see ESPOptions::onDemand)
+	size_t origin = 0; //file offset of mem[0], if it's a copy of the file
 	
-	z_stream strm;
-	memset(&strm,0,sizeof(strm));
-	//if (inflateInit(&strm) != Z_OK) return -1;
-	assert(inflateInit(&strm) == Z_OK);
+	//stream buffer
+	vector<uint8_t> buf;
+	size_t base = 0;	//file offset of buf[0]
+	size_t bpos = 0;
+	size_t bfill = 0;
 	
-	unsigned char* outbuf = new unsigned char[fin_len];
+	void open(MFILE f)
+	{
+		fd = f;
+		base = MFTELL(f);
+		bpos = bfill = 0;
+	}
 	
-	strm.avail_in = to_read;
-	strm.next_in = rdbuf;
-	strm.avail_out = fin_len;
-	strm.next_out = outbuf;
-	int r = inflate(&strm,Z_FINISH);
-	assert(r == Z_STREAM_END);
+	//returns the underlying stream to our logical position
+	void sync()
+	{
+		if (!mem) MFSEEK(fd,tell(),SEEK_SET);
+	}
 	
-	inflateEnd(&strm);
-	delete[] rdbuf;
+	//makes sure n bytes are in the buffer
+	bool fill(size_t n)
+	{
+		if (bfill - bpos >= n) return true;
+		
+		//move the remainder to the front, then top the buffer up
+		if (bpos) {
+			memmove(buf.data(),buf.data()+bpos,bfill-bpos);
+			base += bpos;
+			bfill -= bpos;
+			bpos = 0;
+		}
+		if (buf.size() < max((size_t)READ_BLOCK_SIZE,n)) buf.resize(max((size_t)READ_BLOCK_SIZE,n));
+		bfill += MFREAD(buf.data()+bfill,1,buf.size()-bfill,fd);
+		
+		return (bfill >= n);
+	}
 	
-#if DEBUG_PARSE
-	cout << "Subrecords block inflated" << endl;
+	//returns pointer to the next n bytes without advancing (valid until the next call)
+	const uint8_t* look(size_t n)
+	{
+		if (mem) return (pos + n > len)? NULL : mem + pos;
+		return fill(n)? buf.data() + bpos : NULL;
+	}
+	
+	//same, but advances
+	const uint8_t* fetch(size_t n)
+	{
+		const uint8_t* p = look(n);
+		if (!p) return NULL;
+		if (mem) pos += n;
+		else bpos += n;
+		return p;
+	}
+	
+	//true if fetched data stays valid for the lifetime of the tree
+	bool persistent() const
+	{
+		return mem && !transient;
+	}
+	
+	bool read(void* to, size_t n)
+	{
+		if (!n) return true;
+		const uint8_t* p = fetch(n);
+		if (!p) return false;
+		memcpy(to,p,n);
+		return true;
+	}
+	
+	void seek(long off)
+	{
+		if (mem) {
+			pos += off;
+			return;
+		}
+		
+		//stay within the buffer, if possible
+		long np = (long)bpos + off;
+		if (np >= 0 && np <= (long)bfill) {
+			bpos = np;
+			return;
+		}
+		
+		base += np;
+		bpos = bfill = 0;
+		MFSEEK(fd,base,SEEK_SET);
+	}
+	
+	size_t tell() const
+	{
+		return mem? pos : base + bpos;
+	}
+	
+	//true if nothing is left, and the reader isn't past the end either (blocks seeked over may run past it)
+	bool at_end()
+	{
+		if (mem) return (pos == len);
+		if (look(1)) return false;
+		MFSEEK(fd,0,SEEK_END);
+		bool r = (tell() == (size_t)MFTELL(fd));
+		MFSEEK(fd,base + bfill,SEEK_SET);
+		return r;
+	}
+};
+
+/* Output side: headers and payloads are gathered into a big block, so the whole plugin goes out
+ * in a handful of writes instead of three per record (and per sub-record). */
+struct ESPWriter {
+	MFILE fd;
+	vector<uint8_t> buf;
+	size_t fill = 0;
+	bool ok = true;		//nothing failed to be written so far
+	
+	explicit ESPWriter(MFILE f) : fd(f), buf(WRITE_BLOCK_SIZE) {}
+	
+	~ESPWriter()
+	{
+		flush();
+	}
+	
+	void flush()
+	{
+		if (fill && MFWRITE(buf.data(),1,fill,fd) != fill) ok = false;
+		fill = 0;
+	}
+	
+	void put(const void* p, size_t n)
+	{
+		if (fill + n > buf.size()) {
+			flush();
+			
+			//big blocks (like whole unchanged groups) go straight through
+			if (n >= buf.size()) {
+				if (MFWRITE(p,1,n,fd) != n) ok = false;
+				return;
+			}
+		}
+		if (n) memcpy(buf.data()+fill,p,n);
+		fill += n;
+	}
+};
+
+#ifndef TES4LIB_USE_VFS
+/* Plugin file kept open for the records left in it (see ESPOptions::onDemand). It's checked on every
+ * read, so a file changed in place isn't taken for the one the tree was read from. */
+struct ESPSource {
+	int fd = -1;
+	uint64_t dev = 0, ino = 0, size = 0;
+	int64_t mtime = 0, mtime_ns = 0;
+	
+	~ESPSource()
+	{
+		if (fd >= 0) close(fd);
+	}
+	
+	bool read(void* to, size_t len, uint64_t off) const
+	{
+		struct stat st;
+		if (fstat(fd,&st) || (uint64_t)st.st_size != size || st.st_mtim.tv_sec != mtime || st.st_mtim.tv_nsec != mtime_ns) return false;
+		for (size_t l = 0; l < len;) {
+			ssize_t r = pread(fd,(uint8_t*)to+l,len-l,off+l);
+			if (r <= 0) return false;
+			l += r;
+		}
+		return true;
+	}
+};
+
+//opens the plugin once more (on its own descriptor, as the stream may be closed right after reading)
+static shared_ptr<const ESPSource> open_source(FILE* f)
+{
+	shared_ptr<ESPSource> res = make_shared<ESPSource>();
+	struct stat st;
+	res->fd = dup(fileno(f));
+	if (res->fd < 0 || fstat(res->fd,&st) || !S_ISREG(st.st_mode)) return NULL;
+	res->dev = st.st_dev;
+	res->ino = st.st_ino;
+	res->size = st.st_size;
+	res->mtime = st.st_mtim.tv_sec;
+	res->mtime_ns = st.st_mtim.tv_nsec;
+	return res;
+}
 #endif
 
-	unsigned char* ptr = outbuf;
-	for (unsigned l = 0; l < fin_len;) {
-		MySubRecord srec;
-		//memset(&srec,0,sizeof(srec));
-		
-		memcpy(&(srec.rec),ptr,sizeof(srec.rec));
-		ptr += sizeof(srec.rec);
+template<class T> static T* alloc_node(MyArena* arena)
+{
+	if (!arena) return new T();
+	return new (arena->allocate(sizeof(T),alignof(T))) T(typename T::allocator_type(arena));
+}
+
+//stamps are unique across all the trees, so an index can't be fooled by another tree moved in
+static atomic<uint32_t> esp_stamps(0);
+
+void touch_esp(MyESP &data)
+{
+	data.stamp = ++esp_stamps;
+}
+
+MyGroup* new_group(MyESP &data)
+{
+	touch_esp(data);
+	return alloc_node<MyGroup>(data.arena.get());
+}
+
+MyRecord* new_record(MyESP &data)
+{
+	touch_esp(data);
+	return alloc_node<MyRecord>(data.arena.get());
+}
+
+void remove_group(MyGroup &cur);
+
+//releases a node which didn't make it into the tree (arena nodes go with the arena)
+static void drop_node(MyRecord* node, MyArena* arena)
+{
+	if (!arena) delete node;
+}
+
+static void drop_node(MyGroup* node, MyArena* arena)
+{
+	if (arena) return;
+	remove_group(*node);
+	delete node;
+}
+
+//top-level nodes are moved into MyESP lists, and their shells are released
+template<class T> static void move_node(list<T> &to, T* node, MyArena* arena)
+{
+	to.push_back(std::move(*node));
+	if (!arena) delete node;
+}
+
+//same, but children have to be told where their parent is now
+static void move_node(list<MyGroup> &to, MyGroup* node, MyArena* arena)
+{
+	move_node<MyGroup>(to,node,arena);
+	for (auto &&i : to.back().data) {
+		if (i.isGroup) i.data.grp->parent = &(to.back());
+		else i.data.rec->parent = &(to.back());
+	}
+}
+
+//world, cell and topic children groups follow the record they belong to
+static void link_owner(MyGroup* grp, const MyGroupRecord* prev)
+{
+	int32_t t = grp->grp.groupType;
+	if (t != GRP_WORLD_CHILDREN && t != GRP_CELL_CHILDREN && t != GRP_TOPIC_CHILDREN) return;
+	if (!prev || prev->isGroup) return;
+	
+	uint32_t fid;
+	memcpy(&fid,grp->grp.label,sizeof(fid));
+	if (prev->data.rec->rec.formID == fid) grp->owner = prev->data.rec;
+}
+
+void add_to_group(MyESP &data, MyGroup* grp, MyRecord* rec)
+{
+	MyGroupRecord n;
+	n.isGroup = false;
+	n.data.rec = rec;
+	rec->parent = grp;
+	grp->data.push_back(n);
+	touch_esp(data);
+}
+
+void add_to_group(MyESP &data, MyGroup* grp, MyGroup* sub)
+{
+	MyGroupRecord n;
+	n.isGroup = true;
+	n.data.grp = sub;
+	sub->parent = grp;
+	link_owner(sub,grp->data.empty()? NULL : &(grp->data.back()));
+	grp->data.push_back(n);
+	touch_esp(data);
+}
 
-		if (srec.rec.dataSize) {
-			srec.data.resize(srec.rec.dataSize);
-			memcpy(&(srec.data[0]),ptr,srec.rec.dataSize);
-			ptr += srec.rec.dataSize;
-					
-			l += srec.rec.dataSize;
-			l += sizeof(TES4SubRecord);
-			to->push_back(srec);
+//moves freshly parsed sub-records into record's own (exactly sized) vector
+static void commit_subrecords(MyRecord* rc, vector<MySubRecord> &tmp)
+{
+	rc->data.reserve(rc->data.size() + tmp.size());
+	for (auto &&i : tmp) rc->data.push_back(std::move(i));
+	tmp.clear();
+}
+
+/* Walks through a flat block of sub-records, calling action(header,payload,length,kludgeSize)
+ * for each one of them, until it returns false. Returns false if the block is malformed. */
+template<class F> static bool split_subrecords(const uint8_t* ptr, size_t len, F action)
+{
+	const uint8_t* xxxx = NULL;
+	for (size_t l = 0; l + sizeof(TES4SubRecord) <= len;) {
+		TES4SubRecord hdr;
+		memcpy(&hdr,ptr+l,sizeof(hdr));
+		l += sizeof(hdr);
+		
+		//sub-record can have a zero length
+		uint32_t dlen = hdr.dataSize, kludge = 0;
+		if (!dlen && xxxx) {
+			//The Kludge of Bethesda (are they really was so desperate??)
+			memcpy(&kludge,xxxx,sizeof(kludge)); //ehww
+#if DEBUG_PARSE
+			cout << "Bethesda's kludge detected! Real size is " << kludge << endl;
+#endif
+			dlen = kludge;
 		}
+		if (l + dlen > len) return false;
 		
 #if DEBUG_PARSE
 		cout << "Sub-record ";
-		print4(&(srec.rec));
-		if (!strncmp(srec.rec.subType,"EDID",4)) {
-			uint8_t* ptr1 = &(srec.data[0]);
-			cout << " (" << ptr1 << ")";
-		}
-		cout << " size " << srec.rec.dataSize << endl;
+		print4(&hdr);
+		cout << " size " << dlen << endl;
 #endif
+		xxxx = (!strncmp(hdr.subType,"XXXX",4) && dlen >= sizeof(uint32_t))? ptr+l : NULL;
+		if (!action(hdr,ptr+l,dlen,kludge)) break;
+		
+		//advance inside record's body
+		l += dlen;
 	}
+	return true;
+}
 
-	delete[] outbuf;
-	return 1;
+//turns an inflated block into sub-records (block must be in the arena, if one is given)
+static bool make_subrecords(vector<MySubRecord>* to, const uint8_t* blk, unsigned len, pmr::memory_resource* arena)
+{
+	MySubRecord::allocator_type alloc = arena? MySubRecord::allocator_type(arena) : MySubRecord::allocator_type();
+	return split_subrecords(blk,len,[&] (const TES4SubRecord &hdr, const uint8_t* ptr, uint32_t dlen, uint32_t kludge) {
+		MySubRecord srec(alloc);
+		srec.rec = hdr;
+		srec.kludgeSize = kludge;
+		if (arena) {
+			srec.ext = ptr;
+			srec.extLen = dlen;
+		} else
+			srec.data.assign(ptr,ptr+dlen);
+		to->push_back(std::move(srec));
+		return true;
+	});
+}
+
+int extract_zip_subrecords(vector<MySubRecord>* to, const uint8_t* inbuf, int to_read, unsigned fin_len, pmr::memory_resource* arena)
+{
+	//records living in an arena keep the inflated block there and just reference it
+	unsigned char* outbuf = arena? (unsigned char*)arena->allocate(fin_len,1) : new unsigned char[fin_len];
+	bool ok = get_zip_codec()->inflate(inbuf,to_read,outbuf,fin_len);
+	
+#if DEBUG_PARSE
+	if (ok) cout << "Subrecords block inflated" << endl;
+#endif
+
+	if (ok) ok = make_subrecords(to,outbuf,fin_len,arena);
+
+	if (!arena) delete[] outbuf;
+	return ok? 1 : -1;
 }
 
-int read_next(MFILE esp, MyGroup** grp, MyRecord** rcp)
+/* Inflate pipeline: the reader thread hands compressed blocks over to a pool of workers and
+ * keeps on parsing. Inflated blocks are turned into sub-records back on the reader thread
+ * (which owns the arena), either as they come in, or at the final barrier (finish()). */
+class ESPInflater {
+private:
+	struct Job {
+		MyRecord* rc;
+		const uint8_t* in;
+		vector<uint8_t> inbuf;	//copy of the input if it wasn't mapped
+		size_t in_len;
+		unsigned fin_len;
+		size_t top;				//top-level item the record belongs to
+		uint8_t* out;			//inflated block (in the arena, if any)
+		vector<uint8_t> outbuf;	//or here
+		bool ok = false;
+	};
+	
+	pmr::memory_resource* arena;
+	mutex mtx;
+	condition_variable cv_todo, cv_done;
+	deque<Job*> todo, done;
+	size_t inflight = 0;
+	size_t limit;
+	bool quit = false;
+	size_t bad = SIZE_MAX;	//first top-level item with a block which didn't inflate
+	vector<thread> pool;
+	
+	void worker()
+	{
+		unique_lock<mutex> lk(mtx);
+		for (;;) {
+			cv_todo.wait(lk,[this] { return quit || !todo.empty(); });
+			if (todo.empty()) return;
+			Job* j = todo.front();
+			todo.pop_front();
+			
+			lk.unlock();
+			j->ok = get_zip_codec()->inflate(j->in,j->in_len,j->out,j->fin_len);
+			lk.lock();
+			
+			done.push_back(j);
+			cv_done.notify_one();
+		}
+	}
+	
+	/* A block which doesn't inflate is kept packed, the way ESP_ZIP_LAZY would have it, until
+	 * the reader cuts the tree at the top-level item holding it (see read_esp()). */
+	void commit(Job* j)
+	{
+		vector<MySubRecord> tmp;
+		if (!j->ok || !make_subrecords(&tmp,j->out,j->fin_len,arena)) {
+			tmp.clear();
+			MySubRecord srec(arena? MySubRecord::allocator_type(arena) : MySubRecord::allocator_type());
+			srec.decompLen = j->fin_len;
+			srec.data.assign(j->in,j->in+j->in_len);
+			srec.dontCompress = true;
+			tmp.push_back(std::move(srec));
+			bad = min(bad,j->top);
+		}
+		commit_subrecords(j->rc,tmp);
+		delete j;
+	}
+	
+	//commits all finished jobs; waits until no more than 'upto' jobs are in flight
+	void drain(size_t upto)
+	{
+		for (;;) {
+			deque<Job*> ready;
+			{
+				unique_lock<mutex> lk(mtx);
+				if (inflight > upto) cv_done.wait(lk,[this] { return !done.empty(); });
+				ready.swap(done);
+				inflight -= ready.size();
+			}
+			for (auto &&i : ready) commit(i);
+			if (ready.empty() || inflight <= upto) break;
+		}
+	}
+
+public:
+	ESPInflater(unsigned nthr, pmr::memory_resource* res) : arena(res), limit(nthr * 16)
+	{
+		for (unsigned i = 0; i < nthr; i++) pool.push_back(thread(&ESPInflater::worker,this));
+	}
+	
+	virtual ~ESPInflater()
+	{
+		finish();
+		{
+			lock_guard<mutex> lk(mtx);
+			quit = true;
+		}
+		cv_todo.notify_all();
+		for (auto &&i : pool) i.join();
+	}
+	
+	void push(MyRecord* rc, const uint8_t* in, size_t in_len, unsigned fin_len, bool mapped, size_t top)
+	{
+		Job* j = new Job();
+		j->rc = rc;
+		j->top = top;
+		j->in = in;
+		j->in_len = in_len;
+		j->fin_len = fin_len;
+		if (!mapped) {
+			j->inbuf.assign(in,in+in_len);
+			j->in = j->inbuf.data();
+		}
+		if (arena)
+			j->out = (uint8_t*)arena->allocate(fin_len,1);
+		else {
+			j->outbuf.resize(fin_len);
+			j->out = j->outbuf.data();
+		}
+		
+		{
+			lock_guard<mutex> lk(mtx);
+			todo.push_back(j);
+			inflight++;
+		}
+		cv_todo.notify_one();
+		
+		//pick up whatever is ready, and don't let the queue grow without bounds
+		drain(limit);
+	}
+	
+	//the barrier
+	void finish()
+	{
+		drain(0);
+	}
+	
+	//whether any of the committed blocks were corrupt
+	bool failed() const
+	{
+		return (bad != SIZE_MAX);
+	}
+	
+	//the first top-level item holding a corrupt block (of the committed ones)
+	size_t failedAt() const
+	{
+		return bad;
+	}
+};
+
+//per-thread state of the loader
+struct ESPLoadCtx {
+	const ESPOptions &opts;
+	MyArena* arena;
+	ESPInflater* pipe;
+	size_t top;		//index of the top-level item being read
+};
+
+int read_next(ESPReader &esp, MyGroup** grp, MyRecord** rcp, ESPLoadCtx &ctx)
 {
 	char buf[5];
 	buf[4] = 0;
 	*grp = NULL;
 	*rcp = NULL;
 	
-	//read header type
-	if (MFREAD(buf,1,4,esp) < 4) return -1;
-	
-	//rewind back to record begin and store file position
-	MFSEEK(esp,-4,SEEK_CUR);
-	size_t start = MFTELL(esp);
+	//look at header type and store file position
+	const uint8_t* hdr = esp.look(4);
+	if (!hdr) return -1;
+	memcpy(buf,hdr,4);
+	size_t start = esp.tell();
 	
 	//determine next action
 	if (!strcmp(buf,"GRUP")) {
 #if DEBUG_PARSE
 		cout << "Group" << endl;
 #endif
-		MyGroup* gr = new MyGroup();
-		*grp = gr;
+		MyGroup* gr = alloc_node<MyGroup>(ctx.arena);
+		if (esp.persistent()) gr->orig = hdr;
 		
 		//read the group header block
-		assert(MFREAD(&(gr->grp),sizeof(gr->grp),1,esp));
+		if (!esp.read(&(gr->grp),sizeof(gr->grp))) {
+			drop_node(gr,ctx.arena);
+			return -1;
+		}
+		*grp = gr;
 #if DEBUG_PARSE
 		cout << "Size " << gr->grp.groupSize << endl;
 #endif
 
 		//while length remainder is positive, read gorup's data block
-		for (unsigned l = 0; l < gr->grp.groupSize - sizeof(TES4Group);) {
+		vector<MyGroupRecord> tmp;
+		bool ok = (gr->grp.groupSize >= sizeof(TES4Group));
+		unsigned len = ok? gr->grp.groupSize - sizeof(TES4Group) : 0;
+		for (unsigned l = 0; ok && l < len;) {
 			MyGroup* pgr;
 			MyRecord* prc;
 			
 			//recursive read of embedded block(s)
-			int r = read_next(esp,&pgr,&prc);
-			if (r < 1) break;
+			int r = read_next(esp,&pgr,&prc,ctx);
+			//a broken child (or one running past the group's end) takes the whole group down with it
+			if (r < 1 || l + r > len) {
+				if (pgr) drop_node(pgr,ctx.arena);
+				else if (prc) drop_node(prc,ctx.arena);
+				ok = false;
+				break;
+			}
 			assert(pgr || prc);
 			
 			//create this group's record in our tree
@@ -145,15 +628,30 @@ int read_next(MFILE esp, MyGroup** grp, MyRecord** rcp)
 			if (pgr) {
 				mgr.isGroup = true;
 				mgr.data.grp = pgr;
+				pgr->parent = gr;
+				link_owner(pgr,tmp.empty()? NULL : &(tmp.back()));
 			} else {
 				mgr.isGroup = false;
 				mgr.data.rec = prc;
+				prc->parent = gr;
 			}
-			gr->data.push_back(mgr);
+			tmp.push_back(mgr);
 			
 			//advance (inside this group)
 			l += r;
 		}
+		if (!ok) {
+			//inflate jobs may still be filling the records in
+			if (ctx.pipe) ctx.pipe->finish();
+			for (auto &&i : tmp) {
+				if (i.isGroup) drop_node(i.data.grp,ctx.arena);
+				else drop_node(i.data.rec,ctx.arena);
+			}
+			drop_node(gr,ctx.arena);
+			*grp = NULL;
+			return -1;
+		}
+		gr->data.assign(tmp.begin(),tmp.end());
 		
 	} else {
 		//That's a regular record
@@ -161,110 +659,264 @@ int read_next(MFILE esp, MyGroup** grp, MyRecord** rcp)
 		cout << "Record " << buf << endl;
 #endif
 
-		MyRecord* rc = new MyRecord();
-		*rcp = rc;
+		MyRecord* rc = alloc_node<MyRecord>(ctx.arena);
 		
 		//read record's header
-		assert(MFREAD(&(rc->rec),sizeof(rc->rec),1,esp));
+		if (!esp.read(&(rc->rec),sizeof(rc->rec))) {
+			drop_node(rc,ctx.arena);
+			return -1;
+		}
 #if DEBUG_PARSE
 		cout << "Size " << rc->rec.dataSize << endl;
 #endif
 
-		//read record's body
-		for (unsigned l = 0; l < rc->rec.dataSize;) {
-			MySubRecord srec;
-			//memset(&srec,0,sizeof(srec));
-			bool skip = false;
+		//get record's body: in-place for mapped files, or from the reader's buffer
+		static thread_local vector<MySubRecord> body;
+		uint64_t off = esp.origin + esp.tell();
+		const uint8_t* blk = esp.fetch(rc->rec.dataSize);
+		bool mapped = esp.persistent();
+		if (!blk) {
+			drop_node(rc,ctx.arena);
+			return -1;
+		}
+		
+		//or leave it in the file, to be read on demand (it's still checked, so broken files fail the same way)
+		if (esp.file && !mapped && rc->rec.dataSize && (rc->rec.flags & REC_FLG_ZIP) == 0) {
+			if (!split_subrecords(blk,rc->rec.dataSize,[] (const TES4SubRecord&, const uint8_t*, uint32_t, uint32_t) { return true; })) {
+				drop_node(rc,ctx.arena);
+				return -1;
+			}
+			rc->file = esp.file;
+			rc->offset = off;
+			rc->origLen = rc->rec.dataSize;
+			*rcp = rc;
+			return ((int)(esp.tell()) - (int)start);
+		}
+		
+		//compressed bodies are worth keeping (in the arena), so unchanged records wouldn't be deflated again on save
+		if (!mapped && ctx.arena && (rc->rec.flags & REC_FLG_ZIP)) {
+			uint8_t* keep = (uint8_t*)ctx.arena->allocate(rc->rec.dataSize,1);
+			memcpy(keep,blk,rc->rec.dataSize);
+			blk = keep;
+			mapped = true;
+		}
+		if (mapped) {
+			rc->orig = blk;
+			rc->origLen = rc->rec.dataSize;
+		}
+		
+		MySubRecord::allocator_type alloc = rc->data.get_allocator();
+		bool ok = true;
+		if ((rc->rec.flags & REC_FLG_ZIP) == 0) {
+			//"normal" sub-records data (without zlib stuff)
+			ok = split_subrecords(blk,rc->rec.dataSize,[&] (const TES4SubRecord &hdr, const uint8_t* ptr, uint32_t len, uint32_t kludge) {
+				MySubRecord srec(alloc);
+				srec.rec = hdr;
+				srec.kludgeSize = kludge;
+				if (mapped) {
+					srec.ext = ptr;
+					srec.extLen = len;
+				} else
+					srec.data.assign(ptr,ptr+len);
+				body.push_back(std::move(srec));
+				return true;
+			});
 			
-			if ((rc->rec.flags & REC_FLG_ZIP) == 0) {
-				
-				//read "normal" sub-record data (without zlib stuff)
-				assert(MFREAD(&(srec.rec),sizeof(srec.rec),1,esp));
-#if DEBUG_PARSE
-				memcpy(buf,&(srec.rec.subType),4);
-				cout << "Sub-record " << buf << " size " << srec.rec.dataSize << endl;
-#endif
-
-				//sub-record can have a zero length
-				if (srec.rec.dataSize) {
-					srec.data.resize(srec.rec.dataSize);
-					assert(MFREAD(&(srec.data[0]),srec.rec.dataSize,1,esp));
-					
-					//advance inside record's body
-					l += srec.rec.dataSize;
-					
-				} else {
-					//The Kludge of Bethesda (are they really was so desperate??)
-					if (!rc->data.empty()) {
-						if (!strncmp((rc->data.end()-1)->rec.subType,"XXXX",4)) {
-#if DEBUG_PARSE
-							cout << "Bethesda's kludge detected!" << endl;
-#endif
-							uint32_t* ulptr = (uint32_t*)(&((rc->data.end()-1)->data[0])); //ehww
-#if DEBUG_PARSE
-							cout << "Real size is " << *ulptr << endl;
-#endif
-							srec.kludgeSize = *ulptr;
-							
-							srec.data.resize(srec.kludgeSize);
-							assert(MFREAD(&(srec.data[0]),srec.kludgeSize,1,esp));
-							
-							l += srec.kludgeSize;
-						}
-					}
-				}
-				
-				//don't forget to advance by size of current sub-record's header length
-				l += sizeof(TES4SubRecord);
-				
-			} else {
-				//Well, zlib stuff - read 4 bytes of decompressed length field
-				assert(MFREAD(&(srec.decompLen),sizeof(srec.decompLen),1,esp));
+		} else if (rc->rec.dataSize >= sizeof(uint32_t)) {
+			//Well, zlib stuff - 4 bytes of decompressed length field, then the deflated block
+			MySubRecord srec(alloc);
+			memcpy(&(srec.decompLen),blk,sizeof(srec.decompLen));
 #if DEBUG_PARSE
-				cout << "Sub-record compressed with inflated len = " << srec.decompLen << endl;
+			cout << "Sub-record compressed with inflated len = " << srec.decompLen << endl;
 #endif
-
-				//calculate remainder size
-				int nsize = rc->rec.dataSize;
-				nsize -= sizeof(srec.decompLen);
-				if (nsize > 0) {
+			blk += sizeof(srec.decompLen);
+			int nsize = rc->rec.dataSize - sizeof(srec.decompLen);
+			
+			if (nsize > 0) {
 #if USE_ZLIB
+				if (ctx.opts.zip == ESP_ZIP_EAGER && ctx.pipe)
+					//hand zipped sub-records over to the inflate pipeline (the record is filled in later)
+					ctx.pipe->push(rc,blk,nsize,srec.decompLen,mapped,ctx.top);
+				else if (ctx.opts.zip == ESP_ZIP_EAGER)
 					//pass zipped sub-records into extractor
-					assert(extract_zip_subrecords(&(rc->data),esp,nsize,srec.decompLen) > 0);
-					skip = true;
-#else
-					//or just blindly read'em out and save as-is
-					srec.data.resize(nsize);
-					assert(MFREAD(&(srec.data[0]),nsize,1,esp));
-					srec.dontCompress = true; //next time we'll not compress them "back" - because we haven't decompressed them :)
+					ok = extract_zip_subrecords(&body,blk,nsize,srec.decompLen,ctx.arena) > 0;
+				else
 #endif
+				{
+					//or just blindly save them as-is (unpack_record() will inflate them on demand)
+					if (mapped) {
+						srec.ext = blk;
+						srec.extLen = nsize;
+					} else
+						srec.data.assign(blk,blk+nsize);
+					srec.dontCompress = true; //next time we'll not compress them "back" - because we haven't decompressed them :)
+					body.push_back(std::move(srec));
 				}
-				
-				//advance by full data block size
-				l += rc->rec.dataSize;
 			}
-
-			//we don't want to add some subrecords as they are - e.g., they're compressed
-			if (!skip)
-				rc->data.push_back(srec);
 		}
+		if (!ok) {
+			//malformed body: the load stops here
+			body.clear();
+			drop_node(rc,ctx.arena);
+			return -1;
+		}
+		commit_subrecords(rc,body);
+		*rcp = rc;
 	}
 	
 	//return number of bytes really read
-	return ((int)(MFTELL(esp)) - (int)start);
+	return ((int)(esp.tell()) - (int)start);
+}
+
+//checks the next top-level group against ESPOptions::types, and seeks past it if it's not wanted
+static bool skip_top_group(ESPReader &esp, const ESPOptions &opts)
+{
+	TES4Group hdr;
+	if (!esp.read(&hdr,sizeof(hdr))) return false; //let read_next() deal with the tail
+	
+	if (strncmp(hdr.type,"GRUP",4) || hdr.groupType || hdr.groupSize < sizeof(hdr)
+			|| opts.types.count(string(hdr.label,4))) {
+		esp.seek(-(long)sizeof(hdr));
+		return false;
+	}
+	
+#if DEBUG_PARSE
+	cout << "Skipping group ";
+	print4(hdr.label);
+	cout << endl;
+#endif
+	esp.seek(hdr.groupSize - sizeof(hdr));
+	return true;
+}
+
+struct ESPTopItem {
+	size_t off, len;
+	MyGroup* grp = NULL;
+	MyRecord* rec = NULL;
+};
+
+/* Parallel loader: top-level items are located first (cheap - groupSize chains them),
+ * then parsed by a pool of workers, each with its own reader and arena. */
+static MyESP read_esp_parallel(ESPReader &esp, const ESPOptions &opts)
+{
+	MyESP res;
+	vector<ESPTopItem> items;
+	
+	for (;;) {
+		if (!opts.types.empty() && skip_top_group(esp,opts)) continue;
+		
+		TES4Group hdr; //records have the same header size
+		size_t off = esp.tell();
+		if (esp.at_end()) break;
+		if (!esp.read(&hdr,sizeof(hdr))) {
+			res.complete = false;
+			break;
+		}
+		
+		ESPTopItem it;
+		it.off = off;
+		it.len = strncmp(hdr.type,"GRUP",4)? sizeof(TES4Record) + hdr.groupSize : hdr.groupSize;
+		if (it.len < sizeof(hdr) || off + it.len > esp.len) {
+			res.complete = false;
+			break;
+		}
+		items.push_back(it);
+		esp.seek(it.len - sizeof(hdr));
+	}
+	
+	//biggest groups go first, so the workers would finish at about the same time
+	vector<size_t> order(items.size());
+	for (size_t i = 0; i < order.size(); i++) order[i] = i;
+	sort(order.begin(),order.end(),[&] (size_t a, size_t b) { return items[a].len > items[b].len; });
+	
+	unsigned nthr = esp_workers(items.size(),opts.threads);
+	if (opts.arena) {
+		res.arena = make_shared<MyArena>(); //for the nodes added later
+		for (unsigned t = 0; t < nthr; t++)
+			res.arenas.push_back(make_shared<MyArena>(max(esp.len / nthr,(size_t)(1<<20))));
+	}
+	
+	parallel_for(order.size(),nthr,[&] (size_t n, unsigned t) {
+		ESPTopItem &it = items[order[n]];
+		ESPReader rd = esp;
+		rd.pos = it.off;
+		rd.len = it.off + it.len;
+		ESPLoadCtx ctx = { opts, opts.arena? res.arenas[t].get() : NULL, NULL, order[n] };
+		read_next(rd,&(it.grp),&(it.rec),ctx);
+	});
+	
+	//assemble the tree in original order; like the sequential loader, it stops at the first broken item
+	bool broken = false;
+	for (auto &&i : items) {
+		if (!i.grp && !i.rec) broken = true;
+		if (broken) {
+			res.complete = false;
+			if (i.grp) drop_node(i.grp,res.arena.get());
+			else if (i.rec) drop_node(i.rec,res.arena.get());
+		} else if (i.grp)
+			move_node(res.grps,i.grp,res.arena.get());
+		else
+			move_node(res.recs,i.rec,res.arena.get());
+	}
+	
+	return res;
 }
 
-MyESP read_esp(MFILE esp)
+static MyESP read_esp(ESPReader &esp, const ESPOptions &opts)
 {
+	if (opts.threads != 1 && esp.mem) return read_esp_parallel(esp,opts);
+	
 	MyESP res;
 	MyGroup* pgr;
 	MyRecord* prc;
 	int r;
 	
-	while ((r = read_next(esp,&pgr,&prc)) > 0) {
+	if (opts.arena) res.arena = make_shared<MyArena>(max(esp.len,(size_t)(1<<20)));
+	
+	unique_ptr<ESPInflater> pipe;
+	if (opts.zip == ESP_ZIP_EAGER && opts.inflaters) pipe.reset(new ESPInflater(opts.inflaters,res.arena.get()));
+	ESPLoadCtx ctx = { opts, res.arena.get(), pipe.get(), 0 };
+	vector<bool> kinds; //whether each top-level item is a group (to cut the tree after the pipeline)
+	
+	for (;;) {
+		//top-level groups of unwanted record types are skipped as a whole
+		if (!opts.types.empty() && skip_top_group(esp,opts)) continue;
+		
+		//a compressed record has turned out to be corrupt (the tree is cut below anyway, so it's just a shortcut)
+		if (pipe && pipe->failed()) break;
+		
+		if (esp.at_end()) break;
+		ctx.top = kinds.size();
+		if ((r = read_next(esp,&pgr,&prc,ctx)) < 1) {
+			res.complete = false;
+			break;
+		}
 		assert(pgr || prc);
-		if (pgr) res.grps.push_back(*pgr);
-		else if (prc) res.recs.push_back(*prc);
+		kinds.push_back(pgr != NULL);
+		if (pgr) move_node(res.grps,pgr,res.arena.get());
+		else if (prc) {
+			if (pipe) pipe->finish(); //top-level records are moved, so they must be complete
+			move_node(res.recs,prc,res.arena.get());
+		}
+	}
+	
+	//wait for all the records to be filled in
+	if (pipe) pipe->finish();
+	
+	/* Like the other loaders, stop at the first broken top-level item: the ones holding a corrupt
+	 * compressed record (and everything after them) go, however far the reader got meanwhile */
+	if (pipe && pipe->failed()) {
+		res.complete = false;
+		size_t ngrps = 0, nrecs = 0;
+		for (size_t i = 0; i < min(pipe->failedAt(),kinds.size()); i++) {
+			if (kinds[i]) ngrps++;
+			else nrecs++;
+		}
+		while (res.grps.size() > ngrps) {
+			if (!res.arena) remove_group(res.grps.back());
+			res.grps.pop_back();
+		}
+		while (res.recs.size() > nrecs) res.recs.pop_back();
 	}
 	
 #if DEBUG_PARSE
@@ -275,7 +927,369 @@ MyESP read_esp(MFILE esp)
 	return res;
 }
 
-unsigned compress_zip_subrecords(vector<uint8_t>* to, vector<MySubRecord>* from)
+MyESP read_esp(MFILE esp, const ESPOptions &opts)
+{
+	ESPReader rd;
+	shared_ptr<const ESPSource> file;
+#ifndef TES4LIB_USE_VFS
+	if (opts.onDemand && opts.zip == ESP_ZIP_LAZY && get_esp_residency()) file = open_source(esp);
+	rd.file = file.get();
+#endif
+	if (opts.threads == 1) {
+		rd.open(esp);
+		MyESP res = read_esp(rd,opts);
+		res.file = file;
+		rd.sync();
+		return res;
+	}
+	
+	//parallel loader needs random access, so bring the rest of the file in
+	size_t start = MFTELL(esp);
+	MFSEEK(esp,0,SEEK_END);
+	size_t len = MFTELL(esp);
+	MFSEEK(esp,start,SEEK_SET);
+	len = (len > start)? len - start : 0;
+	if (!len) return MyESP(); //nothing left (and an empty buffer has no memory to parse)
+	
+	vector<uint8_t> buf(len);
+	if (MFREAD(buf.data(),len,1,esp) != 1) {
+		MyESP res;
+		res.complete = false;
+		return res;
+	}
+	
+	rd.mem = buf.data();
+	rd.len = len;
+	rd.transient = true;
+	rd.origin = start;
+	MyESP res = read_esp(rd,opts);
+	res.file = file;
+	return res;
+}
+
+MyESP read_esp_mapped(MFILE esp, const ESPOptions &opts)
+{
+	size_t start = MFTELL(esp);
+	shared_ptr<const uint8_t> src;
+	size_t len = 0;
+	uint64_t dev = 0, ino = 0;
+	bool failed = false;
+	
+#ifndef TES4LIB_USE_VFS
+	//map the whole file; pages are shared with the page cache, nothing is copied
+	struct stat st;
+	if (!fstat(fileno(esp),&st) && st.st_size > 0) {
+		len = st.st_size;
+		void* ptr = mmap(NULL,len,PROT_READ,MAP_PRIVATE,fileno(esp),0);
+		if (ptr != MAP_FAILED) {
+			madvise(ptr,len,(opts.threads == 1)? MADV_SEQUENTIAL : MADV_WILLNEED);
+			src = shared_ptr<const uint8_t>((const uint8_t*)ptr,[len] (const uint8_t* p) { munmap((void*)p,len); });
+			dev = st.st_dev;
+			ino = st.st_ino;
+		}
+	}
+#endif
+	
+	if (!src) {
+		//no mapping available (VFS or mmap failure), so read the file in one go
+		MFSEEK(esp,0,SEEK_END);
+		len = MFTELL(esp);
+		uint8_t* buf = new uint8_t[len];
+		MFSEEK(esp,0,SEEK_SET);
+		if (len && MFREAD(buf,len,1,esp) != 1) {
+			len = 0;
+			failed = true;
+		}
+		src = shared_ptr<const uint8_t>(buf,[] (const uint8_t* p) { delete[] p; });
+	}
+	
+	ESPReader rd;
+	rd.mem = src.get();
+	rd.len = len;
+	rd.pos = (start < len)? start : len;
+	
+	MyESP res = read_esp(rd,opts);
+	if (failed) res.complete = false;
+	res.source = src;
+	res.source_len = len;
+	res.source_dev = dev;
+	res.source_ino = ino;
+	
+	MFSEEK(esp,rd.pos,SEEK_SET);
+	return res;
+}
+
+struct ESPScanState {
+	vector<uint8_t> zbuf;	//inflated sub-records
+	int records = 0;
+	bool stop = false;
+};
+
+/* Streaming counterpart of read_next(): walks the same way, but builds nothing.
+ * Returns 0 at the end of file, -1 if the data is truncated or malformed. */
+static int scan_next(ESPReader &esp, ESPVisitor &vis, ESPScanState &st)
+{
+	//look at header type and store file position
+	if (!esp.look(1)) return 0;
+	const uint8_t* buf = esp.look(4);
+	if (!buf) return -1;
+	size_t start = esp.tell();
+	
+	if (!memcmp(buf,"GRUP",4)) {
+		TES4Group hdr;
+		if (!esp.read(&hdr,sizeof(hdr)) || hdr.groupSize < sizeof(hdr)) return -1;
+		
+		size_t left = hdr.groupSize - sizeof(hdr);
+		ESPScanAction act = vis.group_begin(hdr,start);
+		if (act == ESP_SCAN_STOP)
+			st.stop = true;
+		
+		else if (act == ESP_SCAN_SKIP)
+			esp.seek(left);
+		
+		else {
+			for (size_t l = 0; l < left && !st.stop;) {
+				int r = scan_next(esp,vis,st);
+				if (r < 1) return -1;
+				l += r;
+			}
+			if (!st.stop) vis.group_end(hdr);
+		}
+		
+	} else {
+		TES4Record hdr;
+		if (!esp.read(&hdr,sizeof(hdr))) return -1;
+		st.records++;
+		
+		ESPScanAction act = vis.record(hdr,start);
+		if (act == ESP_SCAN_STOP)
+			st.stop = true;
+		
+		else if (act == ESP_SCAN_SKIP)
+			esp.seek(hdr.dataSize);
+		
+		else {
+			size_t len = hdr.dataSize;
+			const uint8_t* blk = esp.fetch(len);
+			if (!blk) return -1;
+			
+			if ((hdr.flags & REC_FLG_ZIP) && len >= sizeof(uint32_t)) {
+				uint32_t fin_len;
+				memcpy(&fin_len,blk,sizeof(fin_len));
+				st.zbuf.resize(fin_len);
+				if (!get_zip_codec()->inflate(blk+sizeof(fin_len),len-sizeof(fin_len),st.zbuf.data(),fin_len)) return -1;
+				blk = st.zbuf.data();
+				len = fin_len;
+			}
+			
+			bool ok = split_subrecords(blk,len,[&] (const TES4SubRecord &shdr, const uint8_t* ptr, uint32_t dlen, uint32_t) {
+				ESPScanAction a = vis.subrecord(hdr,shdr,ptr,dlen);
+				if (a == ESP_SCAN_STOP) st.stop = true;
+				return (a == ESP_SCAN_CONTINUE);
+			});
+			if (!ok) return -1;
+		}
+	}
+	
+	//return number of bytes really passed
+	return ((int)(esp.tell()) - (int)start);
+}
+
+int scan_esp(MFILE esp, ESPVisitor &visitor)
+{
+	ESPReader rd;
+	rd.open(esp);
+	ESPScanState st;
+	int r;
+	
+	while ((r = scan_next(rd,visitor,st)) > 0 && !st.stop) ;
+	
+	//skipped blocks are seeked over, so they may have run past the end of a truncated file
+	size_t end = rd.tell();
+	if (!st.stop && !r) {
+		MFSEEK(esp,0,SEEK_END);
+		if (end > (size_t)MFTELL(esp)) r = -1;
+	}
+	
+	rd.sync();
+	return (r < 0 && !st.stop)? -1 : st.records;
+}
+
+//reads the first record only (nothing past it is touched)
+int read_esp_header(MFILE esp, MyESPHeader &hdr)
+{
+	hdr = MyESPHeader();
+	TES4Record rec;
+	if (MFREAD(&rec,sizeof(rec),1,esp) != 1 || strncmp(rec.type,"TES4",4)) return -1;
+	hdr.flags = rec.flags;
+	
+	vector<uint8_t> body(rec.dataSize);
+	if (rec.dataSize && MFREAD(body.data(),rec.dataSize,1,esp) != 1) return -1;
+	
+	if (rec.flags & REC_FLG_ZIP) {
+		uint32_t dlen;
+		if (body.size() < sizeof(dlen)) return -1;
+		memcpy(&dlen,body.data(),sizeof(dlen));
+		vector<uint8_t> out(dlen);
+		if (!get_zip_codec()->inflate(body.data()+sizeof(dlen),body.size()-sizeof(dlen),out.data(),dlen)) return -1;
+		body.swap(out);
+	}
+	
+	auto str = [] (const uint8_t* p, uint32_t len) { return string((const char*)p,strnlen((const char*)p,len)); };
+	bool ok = split_subrecords(body.data(),body.size(),[&] (const TES4SubRecord &sh, const uint8_t* p, uint32_t len, uint32_t) {
+		uint32_t t;
+		memcpy(&t,sh.subType,sizeof(t));
+		switch (t) {
+		case FCC_HEDR:
+			if (len >= 12) {
+				memcpy(&hdr.version,p,4);
+				memcpy(&hdr.numRecords,p+4,4);
+				memcpy(&hdr.nextObjectID,p+8,4);
+			}
+			break;
+		case FCC_CNAM: hdr.author = str(p,len); break;
+		case FCC_SNAM: hdr.description = str(p,len); break;
+		case FCC_MAST:
+			hdr.masters.push_back(str(p,len));
+			hdr.masterSizes.push_back(0);
+			break;
+		case FCC_DATA:
+			if (!hdr.masterSizes.empty() && len >= sizeof(uint64_t)) memcpy(&hdr.masterSizes.back(),p,sizeof(uint64_t));
+			break;
+		}
+		return true;
+	});
+	return ok? 1 : -1;
+}
+
+#if USE_ZLIB
+//inflates into a heap block handed over to the residency manager, which may pack the record back later
+static int unpack_resident(MyRecord &rec, ESPResidency &res)
+{
+	const MySubRecord &blob = rec.data[0];
+	uint32_t fin_len = blob.decompLen;
+	uint8_t* blk = new uint8_t[fin_len];
+	
+	vector<MySubRecord> tmp;
+	MySubRecord::allocator_type alloc;
+	bool ok = get_zip_codec()->inflate(blob.bytes(),blob.length(),blk,fin_len) &&
+		split_subrecords(blk,fin_len,[&] (const TES4SubRecord &hdr, const uint8_t* ptr, uint32_t dlen, uint32_t kludge) {
+			MySubRecord srec(alloc);
+			srec.rec = hdr;
+			srec.kludgeSize = kludge;
+			srec.ext = ptr;
+			srec.extLen = dlen;
+			tmp.push_back(std::move(srec));
+			return true;
+		});
+	if (!ok) {
+		delete[] blk;
+		return -1;
+	}
+	
+	rec.data.clear();
+	commit_subrecords(&rec,tmp);
+	res.admit(&rec,blk,fin_len);
+	return 1;
+}
+#endif
+
+#ifndef TES4LIB_USE_VFS
+//reads the body of an unloaded record into blk, and points its sub-records there
+static bool read_body(MyRecord &rec, uint8_t* blk)
+{
+	vector<MySubRecord> tmp;
+	MySubRecord::allocator_type alloc(rec.data.get_allocator());
+	bool ok = rec.file->read(blk,rec.origLen,rec.offset) &&
+		split_subrecords(blk,rec.origLen,[&] (const TES4SubRecord &hdr, const uint8_t* ptr, uint32_t dlen, uint32_t kludge) {
+			MySubRecord srec(alloc);
+			srec.rec = hdr;
+			srec.kludgeSize = kludge;
+			srec.ext = ptr;
+			srec.extLen = dlen;
+			tmp.push_back(std::move(srec));
+			return true;
+		});
+	if (!ok) return false;
+	
+	rec.data.clear();
+	commit_subrecords(&rec,tmp);
+	rec.orig = blk;
+	return true;
+}
+
+/* Brings an unloaded record in: into a heap block handed over to the residency manager (which may
+ * unload it again), or for good, if there's no manager anymore */
+static int load_record(MyRecord &rec)
+{
+	ESPResidency* res = get_esp_residency();
+	pmr::memory_resource* arena = rec.data.get_allocator().resource();
+	if (arena == pmr::get_default_resource()) arena = NULL;
+	
+	if (res) {
+		uint8_t* blk = new uint8_t[max(rec.origLen,1U)];
+		if (!read_body(rec,blk)) {
+			delete[] blk;
+			return -1;
+		}
+		res->admit(&rec,blk,rec.origLen);
+		
+	} else if (arena) {
+		//(a failed read just wastes the block)
+		if (!read_body(rec,(uint8_t*)arena->allocate(max(rec.origLen,1U),1))) return -1;
+		rec.file = NULL;
+		
+	} else {
+		vector<uint8_t> blk(max(rec.origLen,1U));
+		if (!read_body(rec,blk.data())) return -1;
+		for (auto &&i : rec.data) i.unmap();
+		rec.orig = NULL;
+		rec.file = NULL;
+	}
+	return 1;
+}
+#endif
+
+int unpack_record(MyRecord &rec)
+{
+#ifndef TES4LIB_USE_VFS
+	if (rec.unloaded()) return load_record(rec);
+#endif
+	if (!rec.packed()) return 0;
+#if USE_ZLIB
+	ESPResidency* res = get_esp_residency();
+	if (res && rec.orig && rec.origLen > sizeof(uint32_t) && !rec.dirty) return unpack_resident(rec,*res);
+	
+	MySubRecord blob = std::move(rec.data[0]);
+	rec.data.clear();
+	
+	//records living in an arena are inflated into it as well
+	pmr::memory_resource* arena = rec.data.get_allocator().resource();
+	if (arena == pmr::get_default_resource()) arena = NULL;
+	
+	vector<MySubRecord> tmp;
+	int r = extract_zip_subrecords(&tmp,blob.bytes(),blob.length(),blob.decompLen,arena);
+	if (r < 0) {
+		//keep the record as it was
+		tmp.clear();
+		tmp.push_back(std::move(blob));
+	}
+	commit_subrecords(&rec,tmp);
+	return r;
+#else
+	return 0;
+#endif
+}
+
+pmr::vector<MySubRecord>& MyRecord::subs()
+{
+	unpack_record(*this);
+	//(nothing is written otherwise, so read-only lookups in an inflated tree don't race)
+	if (!hot && get_esp_residency()) hot = true;
+	return data;
+}
+
+unsigned compress_zip_subrecords(pmr::vector<uint8_t>* to, pmr::vector<MySubRecord>* from, int level)
 {
 	unsigned total = 0;
 	vector<uint8_t> buf;
@@ -283,7 +1297,7 @@ unsigned compress_zip_subrecords(vector<uint8_t>* to, vector<MySubRecord>* from)
 		size_t p = buf.size();
 		buf.resize(p + sizeof(TES4SubRecord));
 		memcpy(&(buf[p]),&(i.rec),sizeof(i.rec));
-		buf.insert(buf.end(),i.data.begin(),i.data.end());
+		buf.insert(buf.end(),i.bytes(),i.bytes()+i.length());
 		
 		total += buf.size() - p;//sizeof(TES4SubRecord) + i.data.size();
 	}
@@ -291,54 +1305,159 @@ unsigned compress_zip_subrecords(vector<uint8_t>* to, vector<MySubRecord>* from)
 	cout << "Compress total " << total << endl;
 #endif
 	
-	z_stream strm;
-	memset(&strm,0,sizeof(strm));
-	to->resize(total);
-	assert(deflateInit(&strm,OBLIVION_ZLIB_LEVEL) == Z_OK);
-	
-	strm.avail_in = total;
-	strm.avail_out = total;
-	strm.next_in = &(buf[0]);
-	strm.next_out = &((*to)[0]);
+	//the bound covers incompressible data as well
+	ZipCodec* zip = get_zip_codec();
+	to->resize(zip->bound(total));
+	size_t len = zip->deflate(buf.data(),total,to->data(),to->size(),level);
+	if (!len) {
+		cerr << "Stream error." << endl;
+		abort();
+	}
+	to->resize(len);
 	
-#if 0
-	int r = deflate(&strm,Z_FINISH);
-	assert(r == Z_STREAM_END);
-#else
-	do {
-		strm.avail_out = total;
-		strm.next_out = &((*to)[strm.total_out]);
+#if DEBUG_DUMP
+	cout << "Deflated sub-records from " << total << " to " << to->size() << endl;
+#endif
 
-		if (deflate(&strm,Z_FINISH) == Z_STREAM_ERROR) {
-			deflateEnd(&strm);
-			cerr << "Stream error." << endl;
-			abort();
-		}
+	return total;
+}
 
-		to->resize(strm.total_out + total);
-	} while (strm.avail_out == 0);
-	deflateEnd(&strm);
-#endif
+//sub-records' payloads still tile [pos,end): same headers, same order, nothing added, removed or copied in between
+static bool subrecords_tile(const MyRecord &todo, const uint8_t* pos, const uint8_t* end)
+{
+	for (auto &&i : todo.data) {
+		if ((size_t)(end - pos) < sizeof(TES4SubRecord) || i.ext != pos + sizeof(TES4SubRecord)) return false;
+		if (memcmp(pos,&(i.rec),sizeof(TES4SubRecord))) return false;
+		pos += sizeof(TES4SubRecord);
+		if (i.extLen > (size_t)(end - pos)) return false;
+		pos += i.extLen;
+	}
+	return (pos == end);
+}
+
+/* Record can be written back as it was read: it isn't marked as changed, and its sub-records still are
+ * the ones of the original body (so the ones added or removed through subs() aren't lost). Payloads are
+ * only changed by copying them first (see MySubRecord::unmap()), so the ones still referenced in place
+ * are the original bytes. */
+bool record_intact(const MyRecord &todo)
+{
+	if (!todo.orig || todo.dirty) return false;
 	
-	to->resize(strm.total_out);
-#if DEBUG_DUMP
-	cout << "Compressed into " << to->size() << endl;
-#endif
+	if (todo.rec.flags & REC_FLG_ZIP) {
+		if (todo.packed()) return (todo.data[0].ext == todo.orig + sizeof(uint32_t));
+		
+		//inflated ones have to be still referenced in the block they were inflated into (owned copies are re-deflated)
+		uint32_t len;
+		if (todo.origLen < sizeof(len) || todo.data.empty() || !todo.data[0].ext) return false;
+		memcpy(&len,todo.orig,sizeof(len));
+		const uint8_t* blk = todo.data[0].ext - sizeof(TES4SubRecord);
+		return subrecords_tile(todo,blk,blk + len);
+	}
 	
-	deflateEnd(&strm);
-	buf.clear();
+	//payloads still tile the body
+	return subrecords_tile(todo,todo.orig,todo.orig + todo.origLen);
+}
+
+//compressed record which has to be deflated to be written
+static bool need_pack(const MyRecord &todo)
+{
+	return (todo.rec.flags & REC_FLG_ZIP) && !record_intact(todo) && !(todo.data.size() == 1 && todo.data[0].dontCompress);
+}
+
+/* Same as the header in the source, except for the size (it may be recalculated already).
+ * The size is checked by the caller anyway, as it's what makes the nodes follow each other. */
+template<class T> static bool same_header(const T &hdr, const uint8_t* src, uint32_t T::*size)
+{
+	T tmp;
+	memcpy(&tmp,src,sizeof(tmp));
+	tmp.*size = hdr.*size;
+	return !memcmp(&tmp,&hdr,sizeof(tmp));
+}
+
+/* Group can be copied from the mapped source as a whole, if its header and all its children
+ * are unchanged, and the children still follow each other there in the same order */
+static bool group_intact(const MyGroup &todo)
+{
+	if (!todo.orig || !same_header(todo.grp,todo.orig,&TES4Group::groupSize)) return false;
 	
-#if DEBUG_DUMP
-	cout << "Deflated sub-records from " << total << " to " << to->size() << endl;
-#endif
+	const uint8_t* pos = todo.orig + sizeof(TES4Group);
+	TES4Group hdr;
+	memcpy(&hdr,todo.orig,sizeof(hdr));
+	const uint8_t* end = todo.orig + hdr.groupSize;
+	for (auto &&i : todo.data) {
+		if (i.isGroup) {
+			const MyGroup* gr = i.data.grp;
+			if (gr->orig != pos || !group_intact(*gr)) return false;
+			memcpy(&hdr,pos,sizeof(hdr));
+			pos += hdr.groupSize;
+		} else {
+			const MyRecord* rc = i.data.rec;
+			if (!record_intact(*rc) || rc->orig != pos + sizeof(TES4Record)) return false;
+			if (!same_header(rc->rec,pos,&TES4Record::dataSize)) return false;
+			pos += sizeof(TES4Record) + rc->origLen;
+		}
+		if (pos > end) return false;
+	}
+	
+	return (pos == end);
+}
 
-	return total;
+/* Sets sub-records' sizes from their payloads. Anything over 64K gets zero size, and the real
+ * one goes into XXXX sub-record before it (which is added, if it's not there). */
+static void update_subrecords(pmr::vector<MySubRecord> &subs)
+{
+	for (size_t n = 0; n < subs.size(); n++) {
+		MySubRecord &i = subs[n];
+		if (!i.kludgeSize && i.length() <= 0xFFFF) {
+			i.rec.dataSize = i.length();
+			continue;
+		}
+		
+		uint32_t len = i.length();
+		i.rec.dataSize = 0;
+		i.kludgeSize = len;
+		
+		if (!n || strncmp(subs[n-1].rec.subType,"XXXX",4)) {
+			MySubRecord xx(subs.get_allocator());
+			memcpy(xx.rec.subType,"XXXX",4);
+			subs.insert(subs.begin()+n,std::move(xx));
+			n++;
+		}
+		
+		MySubRecord &xx = subs[n-1];
+		if (xx.length() != sizeof(len) || memcmp(xx.bytes(),&len,sizeof(len))) {
+			xx.ext = NULL;
+			xx.extLen = 0;
+			xx.data.assign((uint8_t*)&len,(uint8_t*)&len+sizeof(len));
+		}
+		xx.rec.dataSize = sizeof(len);
+	}
 }
 
-void update_record(MyRecord &todo)
+struct ESPPacked {
+	pmr::vector<uint8_t> data;
+	unsigned decompLen = 0;
+};
+
+/* Saving state. The size pass (update_group/update_record) deflates records into 'packed',
+ * the emit pass (dump_group/dump_record) visits them in the same order and writes the cached
+ * payloads out, so nothing is compressed twice and the tree itself stays unpacked. */
+struct ESPWriteCtx {
+	int level;
+	vector<ESPPacked> packed;
+	size_t sized = 0;	//next entry for the size pass
+	size_t next = 0;	//next entry for the emit pass
+};
+
+void update_record(MyRecord &todo, ESPWriteCtx &ctx)
 {
+	if (todo.unloaded() || record_intact(todo)) {
+		todo.rec.dataSize = todo.origLen;
+		return;
+	}
+	
 	if (todo.rec.flags & REC_FLG_ZIP) {
-		if (todo.data.size() == 1 && todo.data[0].dontCompress) {
+		if (!need_pack(todo)) {
 #if DEBUG_DUMP
 			cout << "Sub-record data of record ";
 			print4(&todo);
@@ -347,28 +1466,25 @@ void update_record(MyRecord &todo)
 			return;
 		}
 		
-		for (auto &&i : todo.data) {
+		//may be deflated already by pack_records()
+		if (ctx.sized == ctx.packed.size()) {
 #if DEBUG_DUMP
 			cout << "Record ";
 			print4(&todo);
-			cout << ": updating compressible sub-record ";
-			print4(&i);
-			cout << endl;
+			cout << ": updating compressible sub-records" << endl;
 #endif
-			i.rec.dataSize = i.data.size();
+			update_subrecords(todo.data);
+			
+			ctx.packed.emplace_back();
+			ESPPacked &nw = ctx.packed.back();
+			nw.decompLen = compress_zip_subrecords(&(nw.data),&(todo.data),ctx.level);
 		}
 		
-		MySubRecord nw;
-		nw.decompLen = compress_zip_subrecords(&(nw.data),&(todo.data));
-		nw.dontCompress = true;
-		
-		todo.data.clear();
-		todo.data.push_back(nw);
-		
-		todo.rec.dataSize = nw.data.size() + 4;
+		todo.rec.dataSize = ctx.packed[ctx.sized++].data.size() + 4;
 		
 	} else {
 		todo.rec.dataSize = 0;
+		update_subrecords(todo.data);
 		
 		for (auto &&i : todo.data) {
 #if DEBUG_DUMP
@@ -379,46 +1495,106 @@ void update_record(MyRecord &todo)
 			cout << endl;
 #endif
 			todo.rec.dataSize += sizeof(TES4SubRecord);
-			i.rec.dataSize = i.data.size();
-			todo.rec.dataSize += i.data.size();
+			todo.rec.dataSize += i.length();
 		}
 	}
 }
 
-int dump_record(MyRecord todo, MFILE esp)
+static void collect_zip_records(MyGroup &grp, vector<MyRecord*> &out)
+{
+	for (auto &&i : grp.data) {
+		if (i.isGroup)
+			collect_zip_records(*(i.data.grp),out);
+		else if (need_pack(*(i.data.rec)))
+			out.push_back(i.data.rec);
+	}
+}
+
+/* Deflates all the compressed records which need it on a pool of workers, in the order
+ * the size pass will ask for them. */
+static void pack_records(MyESP &data, ESPWriteCtx &ctx, unsigned threads)
+{
+	vector<MyRecord*> todo;
+	for (auto &&i : data.recs)
+		if (need_pack(i)) todo.push_back(&i);
+	for (auto &&i : data.grps) collect_zip_records(i,todo);
+	if (todo.empty()) return;
+	
+	//this may add XXXX sub-records, so it's done here (the arena isn't thread-safe)
+	for (auto &&i : todo) update_subrecords(i->data);
+	ctx.packed.resize(todo.size());
+	
+	parallel_for(todo.size(),threads,[&] (size_t n) {
+		ctx.packed[n].decompLen = compress_zip_subrecords(&(ctx.packed[n].data),&(todo[n]->data),ctx.level);
+	});
+}
+
+int dump_record(MyRecord &todo, ESPWriter &esp, ESPWriteCtx &ctx)
 {
 	int tot = sizeof(TES4Record);
 	
-	update_record(todo);
-	MFWRITE(&(todo.rec),sizeof(todo.rec),1,esp);
+	esp.put(&(todo.rec),sizeof(todo.rec));
+	
+	if (record_intact(todo)) {
+		esp.put(todo.orig,todo.origLen);
+		return tot + todo.origLen;
+	}
+	
+#ifndef TES4LIB_USE_VFS
+	//unloaded bodies go from the plugin straight to the output
+	if (todo.unloaded()) {
+		vector<uint8_t> body(todo.origLen);
+		if (!todo.file->read(body.data(),body.size(),todo.offset)) esp.ok = false;
+		esp.put(body.data(),body.size());
+		return tot + todo.origLen;
+	}
+#endif
+	
+	if (need_pack(todo)) {
+		assert(ctx.next < ctx.sized);
+		ESPPacked &p = ctx.packed[ctx.next++];
+		esp.put(&(p.decompLen),sizeof(p.decompLen));
+		esp.put(&(p.data[0]),p.data.size());
+		tot += sizeof(p.decompLen) + p.data.size();
+		
+		p.data = pmr::vector<uint8_t>(); //not needed anymore
+		return tot;
+	}
 	
 	for (auto &&i : todo.data) {
 		if ((todo.rec.flags & REC_FLG_ZIP) == 0) {
-			MFWRITE(&(i.rec),sizeof(i.rec),1,esp);
+			esp.put(&(i.rec),sizeof(i.rec));
 			tot += sizeof(i.rec);
-			MFWRITE(&(i.data[0]),1,i.data.size(),esp);
+			esp.put(i.bytes(),i.length());
 			
 		} else {
 			assert(i.dontCompress);
-			MFWRITE(&(i.decompLen),sizeof(i.decompLen),1,esp);
+			esp.put(&(i.decompLen),sizeof(i.decompLen));
 			tot += sizeof(i.decompLen);
-			MFWRITE(&(i.data[0]),1,i.data.size(),esp);
+			esp.put(i.bytes(),i.length());
 		}
 		
-		tot += i.data.size();
+		tot += i.length();
 	}
 	
 	return tot;
 }
 
-int update_group(MyGroup &todo)
+int update_group(MyGroup &todo, ESPWriteCtx &ctx)
 {
+	if (group_intact(todo)) {
+		TES4Group hdr;
+		memcpy(&hdr,todo.orig,sizeof(hdr));
+		todo.grp.groupSize = hdr.groupSize;
+		return todo.grp.groupSize;
+	}
+	
 	int tot = sizeof(TES4Group); //group data size includes header size
 	for (auto &&i : todo.data) {
 		if (i.isGroup)
-			tot += update_group(*(i.data.grp));
+			tot += update_group(*(i.data.grp),ctx);
 		else {
-			update_record(*(i.data.rec));
+			update_record(*(i.data.rec),ctx);
 			tot += i.data.rec->rec.dataSize;
 			tot += sizeof(TES4Record);
 		}
@@ -427,39 +1603,166 @@ int update_group(MyGroup &todo)
 	return tot;
 }
 
-int dump_group(MyGroup &todo, MFILE esp)
+int dump_group(MyGroup &todo, ESPWriter &esp, ESPWriteCtx &ctx)
 {
+	if (group_intact(todo)) {
+		esp.put(todo.orig,todo.grp.groupSize);
+		return todo.grp.groupSize;
+	}
+	
 	int tot = sizeof(TES4Group);
-	MFWRITE(&(todo.grp),sizeof(todo.grp),1,esp);
+	esp.put(&(todo.grp),sizeof(todo.grp));
 	
 	for (auto &&i : todo.data) {
 		if (i.isGroup)
-			tot += dump_group(*(i.data.grp),esp);
+			tot += dump_group(*(i.data.grp),esp,ctx);
 		else
-			tot += dump_record(*(i.data.rec),esp);
+			tot += dump_record(*(i.data.rec),esp,ctx);
 	}
 	
 	return tot;
 }
 
-void write_esp(MyESP &data, MFILE esp)
+#ifndef TES4LIB_USE_VFS
+//whether the file is the one the tree is mapped from (or reads unloaded records from); len is its size then
+static bool is_source(const MyESP &data, struct stat const &st, size_t &len)
+{
+	if (data.source_ino && (uint64_t)st.st_dev == data.source_dev && (uint64_t)st.st_ino == data.source_ino) {
+		len = data.source_len;
+		return true;
+	}
+	if (data.file && (uint64_t)st.st_dev == data.file->dev && (uint64_t)st.st_ino == data.file->ino) {
+		len = data.file->size;
+		return true;
+	}
+	return false;
+}
+#endif
+
+bool write_esp(MyESP &data, MFILE file, const ESPWriteOptions &opts)
 {
+#ifndef TES4LIB_USE_VFS
+	//saving over the mapped source: the tree has to let go of it first
+	struct stat st;
+	size_t len;
+	if (!fstat(fileno(file),&st) && is_source(data,st,len)) {
+		if ((size_t)st.st_size < len) {
+			cerr << "The plugin was truncated under its tree (call detach_esp() before reopening it for writing)." << endl;
+			return false;
+		}
+		detach_esp(data);
+	}
+#endif
+
+	ESPWriteCtx ctx;
+	ESPWriter esp(file);
+	ctx.level = opts.level;
+	
+	//otherwise records are compressed one by one by the size pass
+	if (opts.threads != 1) pack_records(data,ctx,opts.threads);
+	
 	for (auto &&i : data.recs) {
+		update_record(i,ctx);
 #if DEBUG_DUMP
-		cout << "Record dumped, r = " << dump_record(i,esp) << endl;
+		cout << "Record dumped, r = " << dump_record(i,esp,ctx) << endl;
 #else
-		dump_record(i,esp);
+		dump_record(i,esp,ctx);
 #endif
 	}
 	
-	for (auto i : data.grps) {
-		update_group(i);
+	for (auto &&i : data.grps) {
+		update_group(i,ctx);
 #if DEBUG_DUMP
-		cout << "Group dumped, r = " << dump_group(i,esp) << endl;
+		cout << "Group dumped, r = " << dump_group(i,esp,ctx) << endl;
 #else
-		dump_group(i,esp);
+		dump_group(i,esp,ctx);
+#endif
+	}
+	
+	esp.flush();
+	return esp.ok;
+}
+
+#ifndef TES4LIB_USE_VFS
+bool save_esp(MyESP &data, string const &fn, const ESPWriteOptions &opts)
+{
+	//"wb" truncates the file right away, so the tree mustn't be mapped from it by then
+	struct stat st;
+	size_t len;
+	if (!stat(fn.c_str(),&st) && is_source(data,st,len)) detach_esp(data);
+	
+	FILE* f = fopen(fn.c_str(),"wb");
+	if (!f) return false;
+	bool ok = write_esp(data,f,opts);
+	if (fclose(f)) ok = false;
+	return ok;
+}
 #endif
+
+//copies the body and the payloads of the record found in [lo,hi) to the arena; false if it couldn't be read
+static bool detach_record(MyRecord &rc, const uint8_t* lo, const uint8_t* hi, MyArena &to)
+{
+#ifndef TES4LIB_USE_VFS
+	//bodies left in the plugin are read in now (loaded ones stay where they are, but won't be unloaded again)
+	if (rc.file) {
+		if (rc.unloaded() && !read_body(rc,(uint8_t*)to.allocate(max(rc.origLen,1U),1))) return false;
+		rc.file = NULL;
+	}
+#endif
+	
+	const uint8_t* from = NULL;
+	uint8_t* copy = NULL;
+	if (rc.orig >= lo && rc.orig < hi) {
+		from = rc.orig;
+		copy = (uint8_t*)to.allocate(max(rc.origLen,1U),1);
+		memcpy(copy,rc.orig,rc.origLen);
+		rc.orig = copy;
+	}
+	
+	//(data rather than subs(): packed records stay packed)
+	for (auto &&i : rc.data) {
+		if (!i.ext || i.ext < lo || i.ext >= hi) continue;
+		if (from && i.ext >= from && i.ext + i.extLen <= from + rc.origLen)
+			i.ext = copy + (i.ext - from); //uncompressed payloads tile the body
+		else {
+			uint8_t* p = (uint8_t*)to.allocate(max(i.extLen,1U),1);
+			memcpy(p,i.ext,i.extLen);
+			i.ext = p;
+		}
 	}
+	return true;
+}
+
+static bool detach_group(MyGroup &grp, const uint8_t* lo, const uint8_t* hi, MyArena &to)
+{
+	//groups are just written out child by child from now on
+	if (grp.orig >= lo && grp.orig < hi) grp.orig = NULL;
+	bool ok = true;
+	for (auto &&i : grp.data) {
+		if (i.isGroup) ok &= detach_group(*(i.data.grp),lo,hi,to);
+		else ok &= detach_record(*(i.data.rec),lo,hi,to);
+	}
+	return ok;
+}
+
+void detach_esp(MyESP &data)
+{
+	if (!data.source && !data.file) return;
+	const uint8_t* lo = data.source.get();
+	const uint8_t* hi = lo + data.source_len;
+	
+	//the copies go to an arena of their own, released with the rest of the tree
+	shared_ptr<MyArena> arena = make_shared<MyArena>(max(data.source_len,(size_t)(1<<20)));
+	bool ok = true;
+	for (auto &&i : data.recs) ok &= detach_record(i,lo,hi,*arena);
+	for (auto &&i : data.grps) ok &= detach_group(i,lo,hi,*arena);
+	data.arenas.push_back(arena);
+	
+	//records which couldn't be read (the file was changed) are left unloaded, so writing them fails
+	if (ok) data.file.reset();
+	data.source.reset();
+	data.source_len = 0;
+	data.source_dev = data.source_ino = 0;
 }
 
 void remove_group(MyGroup &cur)
@@ -478,9 +1781,66 @@ void remove_group(MyGroup &cur)
 
 void clear_esp(MyESP &data)
 {
+	//inflated bodies tracked by residency managers go first, while their records are still there
+	forget_esp_residency(data);
+	
 	data.recs.clear();
-	for (auto &&i : data.grps) remove_group(i);
+	//arena-allocated nodes are all released with the arena itself
+	if (!data.arena)
+		for (auto &&i : data.grps) remove_group(i);
 	data.grps.clear();
+	data.arena.reset();
+	data.arenas.clear();
+	data.source.reset();
+	data.source_len = 0;
+	data.source_dev = data.source_ino = 0;
+	data.file.reset();
+	data.snapshot.reset();
+	data.snapshot_len = 0;
+	data.complete = true;
+	touch_esp(data);
+}
+
+//both trees get new stamps: whatever was built on the moved-from one must not take it for the same tree
+MyESP::MyESP(MyESP &&o) :
+	arena(std::move(o.arena)), arenas(std::move(o.arenas)),
+	source(std::move(o.source)), source_len(o.source_len), source_dev(o.source_dev), source_ino(o.source_ino),
+	file(std::move(o.file)), snapshot(std::move(o.snapshot)), snapshot_len(o.snapshot_len),
+	recs(std::move(o.recs)), grps(std::move(o.grps)), complete(o.complete)
+{
+	o.source_len = o.snapshot_len = 0;
+	o.source_dev = o.source_ino = 0;
+	o.complete = true;
+	touch_esp(*this);
+	touch_esp(o);
+}
+
+MyESP& MyESP::operator=(MyESP &&o)
+{
+	if (this == &o) return *this;
+	clear_esp(*this);
+	arena = std::move(o.arena);
+	arenas = std::move(o.arenas);
+	source = std::move(o.source);
+	source_len = o.source_len;
+	source_dev = o.source_dev;
+	source_ino = o.source_ino;
+	file = std::move(o.file);
+	snapshot = std::move(o.snapshot);
+	snapshot_len = o.snapshot_len;
+	recs = std::move(o.recs);
+	grps = std::move(o.grps);
+	complete = o.complete;
+	o.source_len = o.snapshot_len = 0;
+	o.source_dev = o.source_ino = 0;
+	o.complete = true;
+	touch_esp(o);
+	return *this;
+}
+
+MyESP::~MyESP()
+{
+	clear_esp(*this);
 }
 
 }; //TES4
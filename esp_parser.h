@@ -35,6 +35,9 @@
 #include <iostream>
 #include <map>
 #include <list>
+#include <set>
+#include <memory>
+#include <memory_resource>
 #include "zlib.h"
 
 #ifdef TES4LIB_USE_VFS
@@ -61,23 +64,114 @@ enum {
 	REC_FLG_CWT = 0x00080000, 	/*	Can't wait */
 };
 
+enum {
+	GRP_TOP = 0,				/*	Top-level group (label is record type) */
+	GRP_WORLD_CHILDREN = 1,		/*	World children (label is WRLD FormID) */
+	GRP_INT_BLOCK = 2,			/*	Interior cell block */
+	GRP_INT_SUBBLOCK = 3,		/*	Interior cell sub-block */
+	GRP_EXT_BLOCK = 4,			/*	Exterior cell block */
+	GRP_EXT_SUBBLOCK = 5,		/*	Exterior cell sub-block */
+	GRP_CELL_CHILDREN = 6,		/*	Cell children (label is CELL FormID) */
+	GRP_TOPIC_CHILDREN = 7,		/*	Topic children (label is DIAL FormID) */
+	GRP_CELL_PERSISTENT = 8,	/*	Cell persistent children */
+	GRP_CELL_TEMPORARY = 9,		/*	Cell temporary children */
+	GRP_CELL_DISTANT = 10,		/*	Cell visible distant children */
+};
+
+//record and sub-record types as numbers (in their on-disk byte order), to compare them as such
+constexpr uint32_t fourcc(const char* s)
+{
+	return (uint32_t)(uint8_t)s[0] | ((uint32_t)(uint8_t)s[1] << 8) | ((uint32_t)(uint8_t)s[2] << 16) | ((uint32_t)(uint8_t)s[3] << 24);
+}
+
+enum : uint32_t {
+	FCC_TES4 = fourcc("TES4"),
+	FCC_GRUP = fourcc("GRUP"),
+	FCC_CELL = fourcc("CELL"),
+	FCC_WRLD = fourcc("WRLD"),
+	FCC_REFR = fourcc("REFR"),
+	FCC_ACHR = fourcc("ACHR"),
+	FCC_ACRE = fourcc("ACRE"),
+	FCC_DIAL = fourcc("DIAL"),
+	FCC_INFO = fourcc("INFO"),
+	FCC_LAND = fourcc("LAND"),
+	FCC_NPC_ = fourcc("NPC_"),
+	
+	FCC_XXXX = fourcc("XXXX"),
+	FCC_HEDR = fourcc("HEDR"),
+	FCC_MAST = fourcc("MAST"),
+	FCC_EDID = fourcc("EDID"),
+	FCC_FULL = fourcc("FULL"),
+	FCC_NAME = fourcc("NAME"),
+	FCC_DATA = fourcc("DATA"),
+	FCC_SCRI = fourcc("SCRI"),
+	FCC_MODL = fourcc("MODL"),
+	FCC_CNAM = fourcc("CNAM"),
+	FCC_SNAM = fourcc("SNAM"),
+};
+
 struct TES4SubRecord {
 	char subType[4];
 	uint16_t dataSize;
 };
 
+/* Per-plugin node storage: groups, records and their sub-record vectors are bump-allocated
+ * from it when reading, and all released at once by clear_esp() */
+typedef std::pmr::monotonic_buffer_resource MyArena;
+
 struct MySubRecord {
+	typedef std::pmr::polymorphic_allocator<uint8_t> allocator_type;
+	
 	TES4SubRecord rec;
 	uint32_t decompLen = 0;
 	uint32_t kludgeSize = 0;
 	bool dontCompress = false;
-	std::vector<uint8_t> data;
+	std::pmr::vector<uint8_t> data;
+	const uint8_t* ext = NULL; //payload living in the mapped source file or in the arena (not owned)
+	uint32_t extLen = 0;
 	
 	MySubRecord() {
 		memset(&rec,0,sizeof(rec));
 	}
+	
+	explicit MySubRecord(const allocator_type &a) : data(a) {
+		memset(&rec,0,sizeof(rec));
+	}
+	
+	MySubRecord(const MySubRecord &o, const allocator_type &a) :
+		rec(o.rec), decompLen(o.decompLen), kludgeSize(o.kludgeSize), dontCompress(o.dontCompress),
+		data(o.data,a), ext(o.ext), extLen(o.extLen) {}
+	
+	MySubRecord(MySubRecord &&o, const allocator_type &a) :
+		rec(o.rec), decompLen(o.decompLen), kludgeSize(o.kludgeSize), dontCompress(o.dontCompress),
+		data(std::move(o.data),a), ext(o.ext), extLen(o.extLen) {}
+	
+	MySubRecord(const MySubRecord&) = default;
+	MySubRecord(MySubRecord&&) = default;
+	MySubRecord& operator=(const MySubRecord&) = default;
+	MySubRecord& operator=(MySubRecord&&) = default;
+	
+	uint32_t type() const {
+		uint32_t r;
+		memcpy(&r,rec.subType,sizeof(r));
+		return r;
+	}
+	
+	//payload accessors: the bytes are either in a mapped file (ext) or in our own vector (data)
+	const uint8_t* bytes() const	{ return ext? ext : (data.empty()? NULL : &data[0]); }
+	size_t length() const			{ return ext? extLen : data.size(); }
+	
+	//make payload owned (copy-on-write)
+	void unmap() {
+		if (!ext) return;
+		data.assign(ext,ext+extLen);
+		ext = NULL;
+		extLen = 0;
+	}
 };
 
+struct MyGroup;
+struct ESPSource;
 struct TES4Record {
 	char type[4];
 	uint32_t dataSize;
@@ -87,12 +181,44 @@ struct TES4Record {
 };
 
 struct MyRecord {
+	typedef std::pmr::polymorphic_allocator<MySubRecord> allocator_type;
+	
 	TES4Record rec;
-	std::vector<MySubRecord> data;
+	std::pmr::vector<MySubRecord> data;
+	const uint8_t* orig = NULL; //record's body as it was read (in the mapped file or in the arena), if it was kept
+	uint32_t origLen = 0;
+	bool dirty = false; //sub-records were changed, so orig can't be written back (set it when changing payloads through subs() directly)
+	bool hot = false; //touched since the residency manager's clock hand passed it (see esp_resident.h)
+	const ESPSource* file = NULL; //plugin file the body is read back from (see ESPOptions::onDemand)
+	uint64_t offset = 0; //where the body is there
+	MyGroup* parent = NULL; //group containing this record (NULL for top-level records)
 	
 	MyRecord() {
 		memset(&rec,0,sizeof(rec));
 	}
+	
+	explicit MyRecord(const allocator_type &a) : data(a) {
+		memset(&rec,0,sizeof(rec));
+	}
+	
+	uint32_t type() const {
+		uint32_t r;
+		memcpy(&r,rec.type,sizeof(r));
+		return r;
+	}
+	
+	//compressed record which wasn't inflated yet (see ESP_ZIP_LAZY)
+	bool packed() const {
+		return (rec.flags & REC_FLG_ZIP) && data.size() == 1 && data[0].dontCompress && data[0].decompLen;
+	}
+	
+	//body is left in the plugin file, not read yet (or evicted, see ESPOptions::onDemand)
+	bool unloaded() const {
+		return file && !orig;
+	}
+	
+	//sub-records access (inflates a packed record, or reads an unloaded one, on first touch, see ESPZipPolicy)
+	std::pmr::vector<MySubRecord>& subs();
 };
 
 struct TES4Group {
@@ -105,12 +231,27 @@ struct TES4Group {
 
 struct MyGroupRecord;
 struct MyGroup {
+	typedef std::pmr::polymorphic_allocator<MyGroupRecord> allocator_type;
+	
 	TES4Group grp;
-	std::vector<MyGroupRecord> data;
+	std::pmr::vector<MyGroupRecord> data;
+	const uint8_t* orig = NULL; //the whole group with its header, if it was read from a mapped file
+	MyGroup* parent = NULL; //enclosing group (NULL for top-level groups)
+	MyRecord* owner = NULL; //world, cell and topic children groups belong to the record right before them
 	
 	MyGroup() {
 		memset(&grp,0,sizeof(grp));
 	}
+	
+	explicit MyGroup(const allocator_type &a) : data(a) {
+		memset(&grp,0,sizeof(grp));
+	}
+	
+	//children are referenced by pointers, so a copy would share them
+	MyGroup(const MyGroup&) = delete;
+	MyGroup(MyGroup&&) = default;
+	MyGroup& operator=(const MyGroup&) = delete;
+	MyGroup& operator=(MyGroup&&) = default;
 };
 
 struct MyGroupRecord {
@@ -122,18 +263,127 @@ struct MyGroupRecord {
 };
 
 struct MyESP {
+	std::shared_ptr<MyArena> arena; //owns all the nodes below the top level (if ESPOptions::arena was set)
+	std::vector<std::shared_ptr<MyArena>> arenas; //same for the parallel loader (one per thread)
+	std::shared_ptr<const uint8_t> source; //mapped file, if the tree was built by read_esp_mapped() (see detach_esp())
+	size_t source_len = 0;
+	uint64_t source_dev = 0, source_ino = 0; //which file is mapped (both 0 if it's a copy)
+	std::shared_ptr<const ESPSource> file; //plugin the unloaded records are read from (see ESPOptions::onDemand)
+	std::shared_ptr<const uint8_t> snapshot; //mapped snapshot holding inflated payloads, if loaded from the cache (see esp_cache.h)
+	size_t snapshot_len = 0;
 	std::list<MyRecord> recs;
 	std::list<MyGroup> grps;
+	bool complete = true; //false if the plugin turned out to be truncated or malformed (the tree holds the top-level items before that)
+	uint32_t stamp = 0; //changed by the functions below which restructure the tree (lookup indices check it)
+	
+	//the whole tree is owned by MyESP, so it can be moved, but not copied
+	MyESP() {}
+	MyESP(const MyESP&) = delete;
+	MyESP(MyESP &&o);
+	MyESP& operator=(const MyESP&) = delete;
+	MyESP& operator=(MyESP &&o);
+	~MyESP();
+};
+
+/* Leading TES4 record of a plugin: all that's needed to sort a load order and check masters */
+struct MyESPHeader {
+	uint32_t flags = 0;					//record flags (REC_FLG_ESM marks a master)
+	float version = 0;					//HEDR
+	int32_t numRecords = 0;
+	uint32_t nextObjectID = 0;
+	std::string author;					//CNAM
+	std::string description;			//SNAM
+	std::vector<std::string> masters;	//MAST
+	std::vector<uint64_t> masterSizes;	//DATA following each MAST (0 if there's none)
+	
+	bool isMaster() const	{ return flags & REC_FLG_ESM; }
+};
+
+/* Threading: a tree read with ESP_ZIP_EAGER isn't changed by looking at it, so it can be read from several
+ * threads at once. With ESP_ZIP_LAZY, the first access to a record's sub-records (MyRecord::subs(), and so
+ * every accessor) inflates it, which changes the record: such a tree has to be looked at from one thread
+ * at a time (or all of its records have to be inflated first, by unpack_record()). */
+enum ESPZipPolicy {
+	ESP_ZIP_LAZY,	/* keep compressed records packed until their sub-records are accessed */
+	ESP_ZIP_EAGER,	/* inflate everything while reading */
 };
 
+struct ESPOptions {
+	ESPZipPolicy zip = ESP_ZIP_EAGER;
+	bool arena = true; //allocate the tree in a per-plugin arena
+	std::set<std::string> types; //if not empty, read only top-level groups of these record types (e.g. "NPC_")
+	unsigned threads = 1; //parse top-level groups on this many threads (0 = all cores)
+	unsigned inflaters = 0; //with ESP_ZIP_EAGER and a single parser thread, inflate on this many threads (0 = inline)
+	/* With ESP_ZIP_LAZY and a residency manager installed (see esp_resident.h), read_esp() doesn't copy
+	 * uncompressed bodies: the plugin is kept open, and they are read from it on first access. Then they can
+	 * be evicted like inflated ones. The file has to stay as it is, just like a mapped one (it may be replaced
+	 * by renaming another file over it, though). If it's changed in place, unpack_record() fails on them. */
+	bool onDemand = false;
+};
+
+struct ESPWriteOptions {
+	unsigned threads = 1; //deflate compressed records on this many threads before writing (0 = all cores)
+	int level = OBLIVION_ZLIB_LEVEL; //compression level for changed records (see ZipCodec::deflate())
+};
+
+enum ESPScanAction {
+	ESP_SCAN_CONTINUE,
+	ESP_SCAN_SKIP,		/* seek past this group/record (or the rest of record's sub-records) */
+	ESP_SCAN_STOP,		/* abort the whole scan */
+};
+
+/* Callbacks of the streaming parser (see scan_esp()). Nothing is kept between the calls:
+ * sub-record payload pointers are only valid until the callback returns.
+ * scan_esp() returns the number of records seen, or -1 if the file turned out to be truncated
+ * or malformed (a scan stopped by the visitor isn't a failure). */
+class ESPVisitor {
+public:
+	virtual ~ESPVisitor() {}
+	
+	virtual ESPScanAction group_begin(const TES4Group & /*hdr*/, size_t /*offset*/)							{ return ESP_SCAN_CONTINUE; }
+	virtual void group_end(const TES4Group & /*hdr*/)														{}
+	virtual ESPScanAction record(const TES4Record & /*hdr*/, size_t /*offset*/)								{ return ESP_SCAN_CONTINUE; }
+	virtual ESPScanAction subrecord(const TES4Record & /*owner*/, const TES4SubRecord & /*hdr*/, const uint8_t* /*data*/, size_t /*len*/)	{ return ESP_SCAN_CONTINUE; }
+};
+
+//write_esp() returns false if the plugin couldn't be written out (see also detach_esp())
 #ifdef TES4LIB_USE_VFS
-MyESP read_esp(VBFILE* esp);
-void write_esp(MyESP &data, VBFILE* esp);
+MyESP read_esp(VBFILE* esp, const ESPOptions &opts = ESPOptions());
+MyESP read_esp_mapped(VBFILE* esp, const ESPOptions &opts = ESPOptions());
+bool write_esp(MyESP &data, VBFILE* esp, const ESPWriteOptions &opts = ESPWriteOptions());
+int scan_esp(VBFILE* esp, ESPVisitor &visitor);
+int read_esp_header(VBFILE* esp, MyESPHeader &hdr);
 #else
-MyESP read_esp(FILE* esp);
-void write_esp(MyESP &data, FILE* esp);
+MyESP read_esp(FILE* esp, const ESPOptions &opts = ESPOptions());
+MyESP read_esp_mapped(FILE* esp, const ESPOptions &opts = ESPOptions());
+bool write_esp(MyESP &data, FILE* esp, const ESPWriteOptions &opts = ESPWriteOptions());
+int scan_esp(FILE* esp, ESPVisitor &visitor);
+int read_esp_header(FILE* esp, MyESPHeader &hdr);
+//opens the file and writes the plugin there; a tree mapped from that very file is detached first (see detach_esp())
+bool save_esp(MyESP &data, std::string const &fn, const ESPWriteOptions &opts = ESPWriteOptions());
 #endif
 void clear_esp(MyESP &data);
+int unpack_record(MyRecord &rec);
+//the record still matches its original body (MyRecord::orig), so it can be written back as it was read
+bool record_intact(const MyRecord &rec);
+
+/* A tree read by read_esp_mapped() references its file, so the file must not be truncated or rewritten
+ * while the tree is alive (the pages would be gone). This copies everything referenced there into
+ * the tree's own storage and lets the mapping go; call it before opening the plugin's own file for writing,
+ * or use save_esp(), which does. write_esp() detaches the tree by itself when it's handed the mapped file
+ * opened without truncation ("r+b"), and fails if the file is truncated already. */
+void detach_esp(MyESP &data);
+
+//new nodes to be inserted into the plugin's tree (from its arena, if any)
+MyGroup* new_group(MyESP &data);
+MyRecord* new_record(MyESP &data);
+
+//appends a node to the group, keeping its parent link
+void add_to_group(MyESP &data, MyGroup* grp, MyRecord* rec);
+void add_to_group(MyESP &data, MyGroup* grp, MyGroup* sub);
+
+//marks the tree as restructured (call it after moving nodes around or changing FormIDs by hand)
+void touch_esp(MyESP &data);
 
 }; //TES4
 
@@ -0,0 +1,208 @@
+/*
+ * TES4 data file library.
+ * (C) Dmitry 'MatrixS_Master' Solovyev, 2015-2019. All rights reserved.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights to
+ * use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies
+ * of the Software, and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED,
+ * INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A
+ * PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+ * HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+ * OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ *
+ */
+
+#include <set>
+#include <atomic>
+#include "esp_resident.h"
+
+#ifndef TES4LIB_USE_VFS
+#include <sys/mman.h>
+#endif
+
+using namespace std;
+namespace TES4 {
+
+static atomic<ESPResidency*> current_residency(NULL);
+
+//every manager alive: a tree going away is forgotten by the ones which aren't installed anymore as well
+static mutex registry_mtx;
+static set<ESPResidency*> registry;
+
+void set_esp_residency(ESPResidency* res)
+{
+	current_residency = res;
+}
+
+ESPResidency* get_esp_residency()
+{
+	return current_residency;
+}
+
+void forget_esp_residency(MyESP &data)
+{
+	lock_guard<mutex> lk(registry_mtx);
+	for (auto &&i : registry) i->forget(data);
+}
+
+ESPResidency::ESPResidency(size_t bytes) : budget(bytes)
+{
+	lock_guard<mutex> lk(registry_mtx);
+	registry.insert(this);
+}
+
+ESPResidency::~ESPResidency()
+{
+	{
+		lock_guard<mutex> lk(registry_mtx);
+		registry.erase(this);
+	}
+	ESPResidency* me = this;
+	current_residency.compare_exchange_strong(me,NULL); //(it's not there to be used anymore)
+	release();
+	//whatever's left is edited, and has its own copies by now
+}
+
+void ESPResidency::admit(MyRecord* rec, uint8_t* block, size_t bytes)
+{
+	lock_guard<mutex> lk(mtx);
+	Slot s;
+	s.rec = rec;
+	s.block = block;
+	s.bytes = bytes;
+	ring.push_back(s);
+	used += bytes;
+	rec->hot = true;
+	
+	if (autoTrim && used > budget) sweep(budget,rec);
+}
+
+/* Removes the slot, giving the record back its packed body, or leaving it in the file again
+ * (or giving it its own copy of the payloads, if it was edited) */
+void ESPResidency::drop(size_t n)
+{
+	Slot s = ring[n];
+	MyRecord &rec = *(s.rec);
+	bool zip = (rec.rec.flags & REC_FLG_ZIP);
+	
+	if ((zip || rec.file) && record_intact(rec)) {
+		//vectors in an arena can't be released, but they'll be reused as they are
+		if (rec.data.get_allocator().resource() == pmr::get_default_resource())
+			pmr::vector<MySubRecord>().swap(rec.data);
+		else
+			rec.data.clear();
+		
+		if (zip) {
+			//the same state read_next() leaves lazy records in
+			MySubRecord blob(rec.data.get_allocator());
+			memcpy(&(blob.decompLen),rec.orig,sizeof(blob.decompLen));
+			blob.ext = rec.orig + sizeof(blob.decompLen);
+			blob.extLen = rec.origLen - sizeof(blob.decompLen);
+			blob.dontCompress = true;
+			rec.data.push_back(std::move(blob));
+		} else
+			rec.orig = NULL; //unloaded (see ESPOptions::onDemand)
+		evictions++;
+		
+	} else {
+		for (auto &&i : rec.data)
+			if (i.ext >= s.block && i.ext <= s.block + s.bytes) i.unmap();
+		//the body read from the file was in the block
+		if (rec.orig == s.block) {
+			rec.orig = NULL;
+			rec.file = NULL;
+		}
+	}
+	
+	delete[] s.block;
+	used -= s.bytes;
+	ring[n] = ring.back();
+	ring.pop_back();
+}
+
+/* Clock sweep: a touched record gets its bit cleared and a second chance, an untouched one is evicted.
+ * Every slot is visited twice at most, so records touched since the last sweep survive it. */
+void ESPResidency::sweep(size_t target, const MyRecord* keep)
+{
+	for (size_t steps = ring.size() * 2; used > target && !ring.empty() && steps; steps--) {
+		if (hand >= ring.size()) hand = 0;
+		MyRecord* rec = ring[hand].rec;
+		
+		if (rec == keep)
+			hand++;
+		else if (rec->hot) {
+			rec->hot = false;
+			hand++;
+		} else
+			drop(hand); //the last slot moves here, and it's the next one to look at
+	}
+}
+
+void ESPResidency::trim()
+{
+	lock_guard<mutex> lk(mtx);
+	sweep(budget,NULL);
+}
+
+void ESPResidency::release()
+{
+	lock_guard<mutex> lk(mtx);
+	while (!ring.empty()) drop(ring.size() - 1);
+	hand = 0;
+}
+
+void ESPResidency::forget(MyESP &data)
+{
+	if (data.recs.empty() && data.grps.empty()) return;
+	lock_guard<mutex> lk(mtx);
+	if (ring.empty()) return;
+	
+	//the records are found by their top-level ancestors
+	set<const void*> tops;
+	for (auto &&i : data.recs) tops.insert(&i);
+	for (auto &&i : data.grps) tops.insert(&i);
+	
+	for (size_t n = 0; n < ring.size();) {
+		const void* top = ring[n].rec;
+		for (MyGroup* g = ring[n].rec->parent; g; g = g->parent) top = g;
+		if (!tops.count(top)) {
+			n++;
+			continue;
+		}
+		
+		//nodes are about to be released, so nothing has to be restored
+		delete[] ring[n].block;
+		used -= ring[n].bytes;
+		ring[n] = ring.back();
+		ring.pop_back();
+	}
+	if (hand >= ring.size()) hand = 0;
+}
+
+void ESPResidency::trimMapped(MyESP &data)
+{
+#ifndef TES4LIB_USE_VFS
+	//unlike MADV_DONTNEED, these don't lose anything even if the source was read into memory instead
+#if defined(MADV_PAGEOUT)
+	const int advice = MADV_PAGEOUT;
+#elif defined(MADV_COLD)
+	const int advice = MADV_COLD;
+#else
+	const int advice = -1;
+#endif
+	if (advice < 0) return;
+	if (data.source && data.source_len) madvise((void*)data.source.get(),data.source_len,advice);
+	if (data.snapshot && data.snapshot_len) madvise((void*)data.snapshot.get(),data.snapshot_len,advice);
+#endif
+}
+
+}; //TES4
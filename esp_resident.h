@@ -0,0 +1,105 @@
+/*
+ * TES4 data file library.
+ * (C) Dmitry 'MatrixS_Master' Solovyev, 2015-2019. All rights reserved.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights to
+ * use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies
+ * of the Software, and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED,
+ * INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A
+ * PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+ * HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+ * OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ *
+ */
+
+#ifndef ESP_RESIDENT_H_
+#define ESP_RESIDENT_H_
+
+#include <vector>
+#include <mutex>
+#include "esp_parser.h"
+
+namespace TES4 {
+
+/* Memory budget for the inflated bodies of compressed records (of trees read with ESP_ZIP_LAZY), and for
+ * the bodies of records left in the plugin file (see ESPOptions::onDemand).
+ * Once a manager is installed (see set_esp_residency()), unpack_record() inflates clean records which still
+ * have their original body (MyRecord::orig) into heap blocks accounted here, instead of the arena, and reads
+ * unloaded ones into such blocks as well. When the total goes over the budget, cold records are packed back
+ * (or unloaded), to be inflated from the source (or read from the file) again on the next touch. A record is
+ * cold if it wasn't touched (MyRecord::subs()) since the clock hand last passed it: the usual second-chance
+ * approximation of LRU, which costs nothing per access.
+ * The tree, record headers and lookup indices always stay. Uncompressed payloads of mapped trees aren't
+ * counted, as they are in the mapped file (see trimMapped()); copied trees are only bounded if they are read
+ * with ESPOptions::onDemand (load_esp_filelist() does it when a manager is installed). References into
+ * sub-records of a cold record may go away with any other record being brought in; if they have to be held,
+ * turn autoTrim off and call trim() when nothing is being looked at. Touching a record changes it (it's
+ * inflated and marked), so, like any ESP_ZIP_LAZY tree, a managed one must be looked at from one thread at
+ * a time. Positions stay valid, though: a record is only packed back while it's unchanged, so it's inflated
+ * into the same sub-records again. That's what MySubIndex relies on, so its find() goes through
+ * MyRecord::subs() (never keep what it returns, either).
+ * Every manager alive is told about trees going away (by clear_esp()), installed or not, so it can be
+ * uninstalled while it still holds records. Destroying it gives them their bodies back (see release()). */
+class ESPResidency {
+private:
+	struct Slot {
+		MyRecord* rec;
+		uint8_t* block;
+		size_t bytes;
+	};
+
+	std::mutex mtx;
+	std::vector<Slot> ring;			//resident records, in the order they came in
+	size_t hand = 0;				//clock position
+	size_t used = 0;
+	size_t budget;
+	size_t evictions = 0;
+	bool autoTrim = true;
+
+	void drop(size_t n);
+	void sweep(size_t target, const MyRecord* keep);
+
+public:
+	explicit ESPResidency(size_t bytes);
+	ESPResidency(const ESPResidency&) = delete;
+	ESPResidency& operator=(const ESPResidency&) = delete;
+	virtual ~ESPResidency();
+
+	size_t getBudget() const						{ return budget; }
+	size_t getUsed() const							{ return used; }
+	size_t getNumResident() const					{ return ring.size(); }
+	size_t getNumEvictions() const					{ return evictions; }
+	void setBudget(size_t bytes)					{ budget = bytes; }
+	void setAutoTrim(bool on)						{ autoTrim = on; }
+
+	//takes over the freshly inflated (or read) body of a record (called by unpack_record())
+	void admit(MyRecord* rec, uint8_t* block, size_t bytes);
+	//evicts cold records, until the bodies fit the budget
+	void trim();
+	//evicts everything (edited records keep their own copies of the payloads)
+	void release();
+	//forgets the records of a tree which is going away (called by clear_esp())
+	void forget(MyESP &data);
+
+	//asks the kernel to drop the mapped plugin and its snapshot from RSS (pages are read back on touch)
+	static void trimMapped(MyESP &data);
+};
+
+//manager used by unpack_record() (NULL = none, which is the default); it's not owned (destroying it uninstalls it)
+void set_esp_residency(ESPResidency* res);
+ESPResidency* get_esp_residency();
+//tells every manager alive that the tree is going away (called by clear_esp())
+void forget_esp_residency(MyESP &data);
+
+}; //TES4
+
+#endif /* ESP_RESIDENT_H_ */
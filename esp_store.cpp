@@ -0,0 +1,148 @@
+/*
+ * TES4 data file library.
+ * (C) Dmitry 'MatrixS_Master' Solovyev, 2015-2019. All rights reserved.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights to
+ * use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies
+ * of the Software, and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED,
+ * INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A
+ * PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+ * HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+ * OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ *
+ */
+
+#include "esp_store.h"
+#include "libtes4vfs.h"
+
+using namespace std;
+namespace TES4 {
+
+//fills the store from the streaming parser
+class ESPStoreBuilder : public ESPVisitor {
+private:
+	ESPStore &st;
+
+public:
+	bool overflow = false; //the plugin doesn't fit in 32-bit offsets (the scan was stopped)
+
+	ESPStoreBuilder(ESPStore &to) : st(to) {}
+	virtual ~ESPStoreBuilder() {}
+
+	ESPScanAction record(const TES4Record &hdr, size_t) override
+	{
+		if (st.subs.size() >= UINT32_MAX) {
+			overflow = true;
+			return ESP_SCAN_STOP;
+		}
+		ESPStoreRec r;
+		r.rec = hdr;
+		r.first = st.subs.size();
+		r.count = 0;
+		st.recs.push_back(r);
+		return ESP_SCAN_CONTINUE;
+	}
+
+	ESPScanAction subrecord(const TES4Record &, const TES4SubRecord &hdr, const uint8_t* data, size_t len) override
+	{
+		if (len > UINT32_MAX - st.blob.size() || st.subs.size() >= UINT32_MAX) {
+			overflow = true;
+			return ESP_SCAN_STOP;
+		}
+		ESPStoreSub s;
+		memcpy(s.type,hdr.subType,4);
+		s.size = len;
+		s.off = st.blob.size();
+		st.subs.push_back(s);
+		st.blob.insert(st.blob.end(),data,data+len);
+		st.recs.back().count++;
+		return ESP_SCAN_CONTINUE;
+	}
+
+	void finish()
+	{
+		st.recs.shrink_to_fit();
+		st.subs.shrink_to_fit();
+		st.blob.shrink_to_fit();
+	}
+};
+
+void ESPStore::clear()
+{
+	recs.clear();
+	subs.clear();
+	blob.clear();
+}
+
+size_t ESPStore::getMemoryUsage() const
+{
+	return recs.capacity() * sizeof(ESPStoreRec) + subs.capacity() * sizeof(ESPStoreSub) + blob.capacity();
+}
+
+const ESPStoreSub* ESPStore::getSub(size_t rec, const char* type, int cnt) const
+{
+	const ESPStoreRec &r = recs[rec];
+	for (uint32_t i = r.first; i < r.first + r.count; i++)
+		if (!strncmp(subs[i].type,type,4) && !cnt--) return &(subs[i]);
+	return NULL;
+}
+
+bool read_esp_store(MFILE esp, ESPStore &st)
+{
+	ESPStoreBuilder bld(st);
+	st.clear();
+	if (scan_esp(esp,bld) < 0 || bld.overflow) {
+		//truncated or malformed plugin, or one too big for the store: nothing of it is kept
+		st.clear();
+		return false;
+	}
+
+	bld.finish();
+	return true;
+}
+
+bool have_subfield(const ESPStore &st, size_t rec, const char* type)
+{
+	return (st.getSub(rec,type) != NULL);
+}
+
+string get_type(const ESPStore &st, size_t rec)
+{
+	return string(st.getHeader(rec).type,4);
+}
+
+string get_subfield(const ESPStore &st, size_t rec, const char* type)
+{
+	string ret;
+	const ESPStoreSub* s = st.getSub(rec,type);
+	if (!s || s->size < 1) return ret;
+	ret.assign((const char*)st.getPayload(s),s->size-1);
+	return ret;
+}
+
+vector<uint8_t> get_subfield_u8(const ESPStore &st, size_t rec, const char* type)
+{
+	vector<uint8_t> ret;
+	const ESPStoreSub* s = st.getSub(rec,type);
+	if (s) ret.assign(st.getPayload(s),st.getPayload(s)+s->size);
+	return ret;
+}
+
+uint32_t get_subfield_ref(const ESPStore &st, size_t rec, const char* type, int cnt)
+{
+	uint32_t r = 0xFFFFFFFF;
+	const ESPStoreSub* s = st.getSub(rec,type,cnt);
+	if (s && s->size >= sizeof(r)) memcpy(&r,st.getPayload(s),sizeof(r));
+	return r;
+}
+
+}; //TES4
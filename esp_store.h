@@ -0,0 +1,86 @@
+/*
+ * TES4 data file library.
+ * (C) Dmitry 'MatrixS_Master' Solovyev, 2015-2019. All rights reserved.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights to
+ * use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies
+ * of the Software, and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED,
+ * INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A
+ * PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+ * HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+ * OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ *
+ */
+
+#ifndef ESP_STORE_H_
+#define ESP_STORE_H_
+
+#include <vector>
+#include <string>
+#include "esp_parser.h"
+
+namespace TES4 {
+
+/* Compact, read-only alternative to the MyRecord/MySubRecord tree: all sub-record headers
+ * of a plugin live in one array, all payloads in one blob, and records just point at ranges
+ * of headers. It costs 12 bytes per sub-record and 28 bytes per record on top of the payload. */
+
+struct ESPStoreSub {
+	char type[4];
+	uint32_t size;	//real payload size (kludge-aware)
+	uint32_t off;	//offset in the payload blob
+};
+
+struct ESPStoreRec {
+	TES4Record rec;
+	uint32_t first;	//index of the first sub-record header
+	uint32_t count;
+};
+
+class ESPStore {
+private:
+	std::vector<ESPStoreRec> recs;
+	std::vector<ESPStoreSub> subs;
+	std::vector<uint8_t> blob;
+
+	friend class ESPStoreBuilder;
+
+public:
+	ESPStore() {}
+	virtual ~ESPStore() {}
+
+	void clear();
+	size_t getNumRecords() const							{ return recs.size(); }
+	size_t getMemoryUsage() const;
+
+	const TES4Record& getHeader(size_t rec) const			{ return recs[rec].rec; }
+	const ESPStoreSub* getSub(size_t rec, const char* type, int cnt = 0) const;
+	const uint8_t* getPayload(const ESPStoreSub* sub) const	{ return sub? blob.data() + sub->off : NULL; }
+};
+
+//false if the plugin is truncated, malformed or has more than 4 GB of payloads (the store is left empty)
+#ifdef TES4LIB_USE_VFS
+bool read_esp_store(VBFILE* esp, ESPStore &st);
+#else
+bool read_esp_store(FILE* esp, ESPStore &st);
+#endif
+
+//the usual esp_utils accessors for records in a store
+bool have_subfield(const ESPStore &st, size_t rec, const char* type);
+std::string get_type(const ESPStore &st, size_t rec);
+std::string get_subfield(const ESPStore &st, size_t rec, const char* type);
+std::vector<uint8_t> get_subfield_u8(const ESPStore &st, size_t rec, const char* type);
+uint32_t get_subfield_ref(const ESPStore &st, size_t rec, const char* type, int cnt = 0);
+
+}; //TES4
+
+#endif /* ESP_STORE_H_ */
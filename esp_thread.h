@@ -0,0 +1,66 @@
+/*
+ * TES4 data file library.
+ * (C) Dmitry 'MatrixS_Master' Solovyev, 2015-2019. All rights reserved.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights to
+ * use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies
+ * of the Software, and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED,
+ * INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A
+ * PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+ * HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+ * OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ *
+ */
+
+#ifndef ESP_THREAD_H_
+#define ESP_THREAD_H_
+
+#include <vector>
+#include <thread>
+#include <atomic>
+#include <algorithm>
+#include <type_traits>
+
+/* Internal: the worker pool shared by the loaders, the writer and the indexes. */
+
+namespace TES4 {
+
+//number of workers to use for n items (threads = 0 means one per core)
+inline unsigned esp_workers(size_t n, unsigned threads)
+{
+	unsigned nthr = threads? threads : std::thread::hardware_concurrency();
+	return std::max(1U,std::min(nthr,(unsigned)std::min(n,(size_t)0xFFFFFFFF)));
+}
+
+/* Calls f(i) for i = 0..n-1 on esp_workers(n,threads) threads, the calling one included.
+ * The items are handed out one by one, in order; f(i,worker) gets the worker number too,
+ * for the per-worker state (arenas, readers). */
+template<class F> void parallel_for(size_t n, unsigned threads, F f)
+{
+	unsigned nthr = esp_workers(n,threads);
+	std::atomic<size_t> next(0);
+	auto worker = [&] (unsigned t) {
+		for (size_t i; (i = next++) < n;) {
+			if constexpr (std::is_invocable<F&,size_t,unsigned>::value) f(i,t);
+			else f(i);
+		}
+	};
+	
+	std::vector<std::thread> pool;
+	for (unsigned t = 1; t < nthr; t++) pool.push_back(std::thread(worker,t));
+	worker(0);
+	for (auto &&i : pool) i.join();
+}
+
+}; //TES4
+
+#endif /* ESP_THREAD_H_ */
@@ -28,6 +28,15 @@ static const char hex_tab[] = { '0','1','2','3','4','5','6','7','8','9','A','B',
 using namespace std;
 namespace TES4 {
 
+uint32_t global_formid(uint32_t fid, short plugid)
+{
+	if (fid >= 0x01000000) {
+		fid &= 0x00FFFFFF;
+		fid |= (uint32_t)plugid << (3*8);
+	}
+	return fid;
+}
+
 static unsigned harvest_group(MyGroup &grp, short num, function<void(uint32_t,MyRecord*,MyGroup*)> action)
 {
 	unsigned tot = 0;
@@ -37,11 +46,7 @@ static unsigned harvest_group(MyGroup &grp, short num, function<void(uint32_t,My
 			
 		else {
 			tot++;
-			uint32_t fid = i.data.rec->rec.formID;
-			if (fid >= 0x01000000) {
-				fid &= 0x00FFFFFF;
-				fid |= (uint32_t)num << (3*8);
-			}
+			uint32_t fid = global_formid(i.data.rec->rec.formID,num);
 			//printf("formid 0x%08X\n",fid);
 			
 			action(fid,i.data.rec,&grp);
@@ -61,19 +66,53 @@ unsigned harvest(MyESPEntry &rec, FORMIDS &fmap)
 	return tot;
 }
 
+static void index_group(MyGroup &grp, short num, unordered_map<uint32_t,MyRecord*> &to)
+{
+	for (auto &&i : grp.data) {
+		if (i.isGroup)
+			index_group(*(i.data.grp),num,to);
+		else
+			to[global_formid(i.data.rec->rec.formID,num)] = i.data.rec;
+	}
+}
+
+static void build_fidx(MyESPEntry &rec)
+{
+	rec.fidx.clear();
+	//same winner as the full scan had: the first top-level group with the FormID, and the last record in it
+	for (auto i = rec.data.grps.rbegin(); i != rec.data.grps.rend(); ++i)
+		index_group(*i,rec.plugid,rec.fidx);
+	rec.fidx_stamp = rec.data.stamp;
+	rec.fidx_valid = true;
+}
+
 MyRecord* retrieve(MyESPEntry &rec, uint32_t fid)
 {
-	MyRecord* ptr = NULL;
-	for (auto &&i : rec.data.grps) {
-		harvest_group(i,rec.plugid, [&] (uint32_t id, MyRecord* p, MyGroup*) {
-			if (id == fid) ptr = p; } );
-		if (ptr) break;
+	if (!rec.fidx_valid || rec.fidx_stamp != rec.data.stamp) build_fidx(rec);
+	
+	auto it = rec.fidx.find(fid);
+	if (it == rec.fidx.end()) return NULL;
+	
+	//record's FormID might have been changed in place since then
+	if (global_formid(it->second->rec.formID,rec.plugid) != fid) {
+		build_fidx(rec);
+		it = rec.fidx.find(fid);
+		if (it == rec.fidx.end()) return NULL;
 	}
-	return ptr;
+	return it->second;
+}
+
+void invalidate_indices(MyESPEntry &rec)
+{
+	rec.fidx.clear();
+	rec.fidx_valid = false;
 }
 
 MyGroup* get_parent_group(MyESPEntry &rec, MyRecord* child)
 {
+	if (child->parent) return child->parent;
+	
+	//nodes linked by hand (not with add_to_group()) have to be searched for
 	MyGroup* ptr = NULL;
 	for (auto &&i : rec.data.grps) {
 		harvest_group(i,rec.plugid, [&] (uint32_t, MyRecord* cur, MyGroup* grp) {
@@ -83,6 +122,31 @@ MyGroup* get_parent_group(MyESPEntry &rec, MyRecord* child)
 	return ptr;
 }
 
+vector<MyGroupRecord> get_ancestry(MyRecord* child)
+{
+	vector<MyGroupRecord> res;
+	for (MyGroup* i = child->parent; i; i = i->parent) {
+		MyGroupRecord n;
+		n.isGroup = true;
+		n.data.grp = i;
+		res.push_back(n);
+		
+		if (i->owner) {
+			n.isGroup = false;
+			n.data.rec = i->owner;
+			res.push_back(n);
+		}
+	}
+	return res;
+}
+
+MyRecord* get_cell(MyRecord* child)
+{
+	for (MyGroup* i = child->parent; i; i = i->parent)
+		if (i->grp.groupType == GRP_CELL_CHILDREN) return i->owner;
+	return NULL;
+}
+
 bool equ_ignorecase(string a, string b)
 {
 	for (auto &i : a) i = toupper(i);
@@ -90,15 +154,29 @@ bool equ_ignorecase(string a, string b)
 	return (a == b);
 }
 
+//type name to number (names may be shorter than 4 chars)
+static uint32_t type_code(const char* type)
+{
+	char buf[4] = { 0, 0, 0, 0 };
+	for (int i = 0; i < 4 && type[i]; i++) buf[i] = type[i];
+	return fourcc(buf);
+}
+
+MySubRecord* find_subfield(MyRecord* ptr, uint32_t type, int cnt)
+{
+	for (auto &&i : ptr->subs())
+		if (i.type() == type && !cnt--) return &i;
+	return NULL;
+}
+
+bool have_subfield(MyRecord* ptr, uint32_t type)
+{
+	return find_subfield(ptr,type) != NULL;
+}
+
 bool have_subfield(MyRecord* ptr, const char* type)
 {
-	bool r = false;
-	for (auto &&i : ptr->data) 
-		if (!strncmp(i.rec.subType,type,4)) {
-			r = true;
-			break;
-		}
-	return r;
+	return have_subfield(ptr,type_code(type));
 }
 
 string get_type(MyRecord* ptr)
@@ -109,62 +187,115 @@ string get_type(MyRecord* ptr)
 	return ret;
 }
 
+string_view get_subfield_view(MyRecord* ptr, uint32_t type)
+{
+	MySubRecord* i = find_subfield(ptr,type);
+	if (!i || !i->length()) return string_view();
+	
+	size_t len = i->length();
+	if (!i->bytes()[len-1]) len--;
+	return string_view((const char*)i->bytes(),len);
+}
+
+MySpan get_subfield_span(MyRecord* ptr, uint32_t type, int cnt)
+{
+	MySpan r;
+	MySubRecord* i = find_subfield(ptr,type,cnt);
+	if (i) {
+		r.ptr = i->bytes();
+		r.len = i->length();
+	}
+	return r;
+}
+
 string get_subfield(MyRecord* ptr, const char* type)
 {
 	string ret;
-	for (auto &&i : ptr->data) 
-		if (!strncmp(i.rec.subType,type,4)) {
-			//assert(i.rec.dataSize < 512);
-			if (i.rec.dataSize < 1) return ret;
-			ret.resize(i.rec.dataSize-1);
-			memcpy(&(ret[0]),&(i.data[0]),i.rec.dataSize-1);
-			break;
-		}
+	MySubRecord* i = find_subfield(ptr,type_code(type));
+	//assert(i->rec.dataSize < 512);
+	if (!i || i->length() < 1) return ret;
+	ret.resize(i->length()-1);
+	memcpy(&(ret[0]),i->bytes(),i->length()-1);
 	return ret;
 }
 
 vector<uint8_t> get_subfield_u8(MyRecord* ptr, const char* type)
 {
 	vector<uint8_t> ret;
-	for (auto &&i : ptr->data) 
-		if (!strncmp(i.rec.subType,type,4)) {
-			ret = i.data;
-			ret.resize(i.rec.dataSize);
-			break;
-		}
+	MySubRecord* i = find_subfield(ptr,type_code(type));
+	if (i) {
+		ret.assign(i->bytes(),i->bytes()+i->length());
+		ret.resize(i->rec.dataSize);
+	}
 	return ret;
 }
 
-uint32_t get_subfield_ref(MyRecord* ptr, const char* type, int cnt)
+uint32_t get_subfield_ref(MyRecord* ptr, uint32_t type, int cnt)
 {
 	uint32_t r = 0xFFFFFFFF;
-	for (auto &&i : ptr->data)
-		if (!strncmp(i.rec.subType,type,4) && !cnt--) {
-			r = *(uint32_t*)&(i.data[0]);
-			break;
-		}
+	MySubRecord* i = find_subfield(ptr,type,cnt);
+	if (i && i->length() >= sizeof(r)) memcpy(&r,i->bytes(),sizeof(r));
 	return r;
 }
 
+uint32_t get_subfield_ref(MyRecord* ptr, const char* type, int cnt)
+{
+	return get_subfield_ref(ptr,type_code(type),cnt);
+}
+
+void MySubIndex::build(MyRecord* ptr)
+{
+	rec = ptr;
+	pos.clear();
+	auto &subs = ptr->subs();
+	pos.reserve(subs.size());
+	for (size_t i = 0; i < subs.size(); i++) pos.push_back(pair<uint32_t,uint32_t>(subs[i].type(),i));
+	sort(pos.begin(),pos.end());
+}
+
+MySubRecord* MySubIndex::find(uint32_t type, int cnt) const
+{
+	auto it = lower_bound(pos.begin(),pos.end(),pair<uint32_t,uint32_t>(type,0));
+	if (cnt < 0 || pos.end() - it <= cnt || it[cnt].first != type) return NULL;
+	
+	//the record may have been packed back meanwhile (see esp_resident.h): it's inflated the same way again
+	auto &subs = rec->subs();
+	size_t n = it[cnt].second;
+	if (n >= subs.size() || subs[n].type() != type) return NULL; //changed since build()
+	return &(subs[n]);
+}
+
+size_t MySubIndex::count(uint32_t type) const
+{
+	auto r = equal_range(pos.begin(),pos.end(),pair<uint32_t,uint32_t>(type,0),[] (const pair<uint32_t,uint32_t> &a, const pair<uint32_t,uint32_t> &b) { return a.first < b.first; });
+	return r.second - r.first;
+}
+
 void set_subfield(MyRecord* ptr, const char* type, string content)
 {
-	for (auto &&i : ptr->data) {
+	for (auto &&i : ptr->subs()) {
 		if (strncmp(i.rec.subType,type,4)) continue;
 		//assert(content.size() < 512);
 		i.rec.dataSize = content.size() + 1;
+		i.ext = NULL; //drop the mapped payload, if any
+		i.extLen = 0;
 		i.data.clear();
 		i.data.resize(i.rec.dataSize,0);
 		memcpy(&(i.data[0]),content.c_str(),i.rec.dataSize);
+		ptr->dirty = true;
 		break;
 	}
 }
 
 void set_subfield_u8(MyRecord* ptr, const char* type, vector<uint8_t> content)
 {
-	for (auto &&i : ptr->data) 
+	for (auto &&i : ptr->subs()) 
 		if (!strncmp(i.rec.subType,type,4)) {
-			i.data = content;
+			i.data.assign(content.begin(),content.end());
+			i.ext = NULL;
+			i.extLen = 0;
 			i.rec.dataSize = content.size();
+			ptr->dirty = true;
 			break;
 		}
 }
@@ -192,4 +323,35 @@ void set_subfield_u8(MyRecord* ptr, const char* type, string content)
 	set_subfield_u8(ptr,type,buf);
 }
 
+MySubRecord* add_subfield_u8(MyRecord* ptr, const char* type, vector<uint8_t> content, int pos)
+{
+	auto &subs = ptr->subs();
+	MySubRecord nw(subs.get_allocator());
+	memcpy(nw.rec.subType,type,sizeof(nw.rec.subType));
+	nw.rec.dataSize = content.size();
+	nw.data.assign(content.begin(),content.end());
+	
+	if (pos < 0 || (size_t)pos > subs.size()) pos = subs.size();
+	ptr->dirty = true;
+	return &*(subs.insert(subs.begin()+pos,std::move(nw)));
+}
+
+MySubRecord* add_subfield(MyRecord* ptr, const char* type, string content, int pos)
+{
+	//zstring, with the terminating zero
+	return add_subfield_u8(ptr,type,vector<uint8_t>(content.c_str(),content.c_str()+content.size()+1),pos);
+}
+
+bool remove_subfield(MyRecord* ptr, const char* type, int cnt)
+{
+	auto &subs = ptr->subs();
+	for (auto i = subs.begin(); i != subs.end(); ++i) {
+		if (strncmp(i->rec.subType,type,4) || cnt--) continue;
+		subs.erase(i);
+		ptr->dirty = true;
+		return true;
+	}
+	return false;
+}
+
 }; //TES4
@@ -26,6 +26,7 @@
 
 #include <vector>
 #include <string>
+#include <string_view>
 #include <iostream>
 #include <map>
 #include <unordered_map>
@@ -41,14 +42,30 @@ struct MyESPEntry {
 	std::string name;
 	MyESP data;
 	short plugid;
+	MyESPHeader header; //leading record, as scanned for the load order
+	
+	//lookup tables, built on first use, rebuilt when data.stamp changes (not thread-safe)
+	std::unordered_map<uint32_t,MyRecord*> fidx;
+	uint32_t fidx_stamp = 0;
+	bool fidx_valid = false;
 };
 
-typedef std::multimap<uint32_t,std::pair<std::string,MyRecord*>> FORMIDS;
+typedef std::multimap<uint32_t,std::pair<std::string,MyRecord*>> FORMIDS; //see FormIDIndex (esp_index.h) for a leaner one
+
+//FormID as seen in the load order: non-base ones get plugin's load order byte
+uint32_t global_formid(uint32_t fid, short plugid);
 
 unsigned harvest(MyESPEntry &rec, FORMIDS &fmap);
 MyRecord* retrieve(MyESPEntry &rec, uint32_t fid);
+void invalidate_indices(MyESPEntry &rec);
 MyGroup* get_parent_group(MyESPEntry &rec, MyRecord* child);
 
+//groups up from the record to the top, each followed by its owner record, if there's one
+//(e.g. REFR: temporary children, cell children, CELL, sub-block, block, world children, WRLD, top)
+std::vector<MyGroupRecord> get_ancestry(MyRecord* child);
+//the cell a reference (or anything else in cell children) belongs to
+MyRecord* get_cell(MyRecord* child);
+
 bool equ_ignorecase(std::string a, std::string b);
 bool have_subfield(MyRecord* ptr, const char* type);
 
@@ -57,10 +74,54 @@ std::string get_subfield(MyRecord* ptr, const char* type);
 std::vector<uint8_t> get_subfield_u8(MyRecord* ptr, const char* type);
 uint32_t get_subfield_ref(MyRecord* ptr, const char* type, int cnt = 0);
 
+//read-only view of sub-record's payload (valid until the record is changed or unloaded)
+struct MySpan {
+	const uint8_t* ptr = NULL;
+	size_t len = 0;
+	
+	const uint8_t* data() const			{ return ptr; }
+	size_t size() const					{ return len; }
+	bool empty() const					{ return !len; }
+	const uint8_t* begin() const		{ return ptr; }
+	const uint8_t* end() const			{ return ptr + len; }
+	uint8_t operator[](size_t i) const	{ return ptr[i]; }
+};
+
+//same accessors with numeric types (see fourcc()), and without copying anything
+MySubRecord* find_subfield(MyRecord* ptr, uint32_t type, int cnt = 0);
+bool have_subfield(MyRecord* ptr, uint32_t type);
+std::string_view get_subfield_view(MyRecord* ptr, uint32_t type); //zstring, without the terminating zero
+MySpan get_subfield_span(MyRecord* ptr, uint32_t type, int cnt = 0);
+uint32_t get_subfield_ref(MyRecord* ptr, uint32_t type, int cnt = 0);
+
+/* Type -> position table of record's sub-records, for records with lots of them (like NPC_ or LAND)
+ * which are queried many times. It has to be rebuilt after the record's sub-records are changed
+ * (find() returns NULL for the positions which don't match anymore). */
+class MySubIndex {
+private:
+	MyRecord* rec = NULL;
+	std::vector<std::pair<uint32_t,uint32_t>> pos; //(type, position), sorted
+
+public:
+	MySubIndex() {}
+	explicit MySubIndex(MyRecord* ptr)		{ build(ptr); }
+	virtual ~MySubIndex() {}
+
+	void build(MyRecord* ptr);
+	MySubRecord* find(uint32_t type, int cnt = 0) const;
+	size_t count(uint32_t type) const;
+};
+
 void set_subfield(MyRecord* ptr, const char* type, std::string content);
 void set_subfield_u8(MyRecord* ptr, const char* type, std::vector<uint8_t> content);
 void set_subfield_u8(MyRecord* ptr, const char* type, std::string content);
 
+//inserts a sub-record before the one at position pos (-1 = at the end); these mark the record as changed
+MySubRecord* add_subfield(MyRecord* ptr, const char* type, std::string content, int pos = -1);
+MySubRecord* add_subfield_u8(MyRecord* ptr, const char* type, std::vector<uint8_t> content, int pos = -1);
+//removes the cnt-th sub-record of the type (false if there's no such one)
+bool remove_subfield(MyRecord* ptr, const char* type, int cnt = 0);
+
 }; //TES4
 
 #endif /*ESP_UTILS_H_*/
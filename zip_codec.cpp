@@ -0,0 +1,144 @@
+/*
+ * TES4 data file library.
+ * (C) Dmitry 'MatrixS_Master' Solovyev, 2015-2019. All rights reserved.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights to
+ * use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies
+ * of the Software, and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED,
+ * INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A
+ * PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+ * HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+ * OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ *
+ */
+
+#include <string.h>
+#include <atomic>
+#include "zlib.h"
+#ifdef TES4LIB_USE_LIBDEFLATE
+#include "libdeflate.h"
+#endif
+#include "zip_codec.h"
+
+using namespace std;
+namespace TES4 {
+
+class ZlibCodec : public ZipCodec {
+public:
+	const char* getName()		{ return "zlib"; }
+	size_t bound(size_t len)	{ return compressBound(len); }
+	
+	bool inflate(const uint8_t* in, size_t in_len, uint8_t* out, size_t out_len)
+	{
+		z_stream strm;
+		memset(&strm,0,sizeof(strm));
+		if (inflateInit(&strm) != Z_OK) return false;
+		
+		strm.avail_in = in_len;
+		strm.next_in = (Bytef*)in;
+		strm.avail_out = out_len;
+		strm.next_out = out;
+		int r = ::inflate(&strm,Z_FINISH);
+		
+		//a stream ending early would leave the tail of the buffer unset
+		inflateEnd(&strm);
+		return (r == Z_STREAM_END && strm.total_out == out_len);
+	}
+	
+	size_t deflate(const uint8_t* in, size_t in_len, uint8_t* out, size_t out_max, int level)
+	{
+		//zlib has levels 0-9 only (and fails on anything else)
+		level = (level < 0)? Z_DEFAULT_COMPRESSION : ((level > 9)? 9 : level);
+		uLongf len = out_max;
+		if (compress2(out,&len,in,in_len,level) != Z_OK) return 0;
+		return len;
+	}
+};
+
+#ifdef TES4LIB_USE_LIBDEFLATE
+/* libdeflate works on whole buffers only (which is all we need), and is a lot faster than zlib
+ * both ways. Its output is still a valid zlib stream, but not the same bytes zlib would make. */
+class LibdeflateCodec : public ZipCodec {
+private:
+	//(de)compressors can't be shared between threads, so every thread gets its own set
+	struct State {
+		libdeflate_decompressor* dec = NULL;
+		libdeflate_compressor* enc[13] = {};
+		
+		~State()
+		{
+			if (dec) libdeflate_free_decompressor(dec);
+			for (auto &&i : enc) if (i) libdeflate_free_compressor(i);
+		}
+	};
+	
+	static State& state()
+	{
+		static thread_local State st;
+		return st;
+	}
+	
+	static libdeflate_compressor* compressor(int level)
+	{
+		level = (level < 0)? 0 : ((level > 12)? 12 : level);
+		State &st = state();
+		if (!st.enc[level]) st.enc[level] = libdeflate_alloc_compressor(level);
+		return st.enc[level];
+	}
+
+public:
+	const char* getName()		{ return "libdeflate"; }
+	size_t bound(size_t len)	{ return libdeflate_zlib_compress_bound(compressor(6),len); }
+	
+	bool inflate(const uint8_t* in, size_t in_len, uint8_t* out, size_t out_len)
+	{
+		State &st = state();
+		if (!st.dec && !(st.dec = libdeflate_alloc_decompressor())) return false;
+		
+		//without the actual size, a stream which doesn't fill the buffer is an error (LIBDEFLATE_SHORT_OUTPUT)
+		return (libdeflate_zlib_decompress(st.dec,in,in_len,out,out_len,NULL) == LIBDEFLATE_SUCCESS);
+	}
+	
+	size_t deflate(const uint8_t* in, size_t in_len, uint8_t* out, size_t out_max, int level)
+	{
+		libdeflate_compressor* c = compressor(level);
+		return c? libdeflate_zlib_compress(c,in,in_len,out,out_max) : 0;
+	}
+};
+#endif
+
+static ZlibCodec zlib_codec;
+#ifdef TES4LIB_USE_LIBDEFLATE
+static LibdeflateCodec libdeflate_codec;
+#define DEFAULT_CODEC (&libdeflate_codec)
+#else
+#define DEFAULT_CODEC (&zlib_codec)
+#endif
+
+static atomic<ZipCodec*> current_codec(DEFAULT_CODEC);
+
+ZipCodec* get_zip_codec()
+{
+	return current_codec;
+}
+
+void set_zip_codec(ZipCodec* codec)
+{
+	current_codec = codec? codec : DEFAULT_CODEC;
+}
+
+ZipCodec* get_zlib_codec()
+{
+	return &zlib_codec;
+}
+
+}; //TES4
@@ -0,0 +1,62 @@
+/*
+ * TES4 data file library.
+ * (C) Dmitry 'MatrixS_Master' Solovyev, 2015-2019. All rights reserved.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights to
+ * use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies
+ * of the Software, and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED,
+ * INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A
+ * PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+ * HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+ * OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ *
+ */
+
+#ifndef ZIP_CODEC_H_
+#define ZIP_CODEC_H_
+
+#include <inttypes.h>
+#include <stddef.h>
+
+namespace TES4 {
+
+/* Whole-buffer codec for zlib-wrapped deflate streams (compressed records and BSA files).
+ * Backends must produce streams the game can read, and must be thread-safe, since loaders
+ * and the writer call them from their worker threads. */
+class ZipCodec {
+public:
+	virtual ~ZipCodec() {}
+	
+	virtual const char* getName() = 0;
+	
+	//inflates into a buffer of out_len bytes; false if the stream is broken or doesn't fill it exactly
+	virtual bool inflate(const uint8_t* in, size_t in_len, uint8_t* out, size_t out_len) = 0;
+	
+	//max. size of deflate() output for len bytes of input
+	virtual size_t bound(size_t len) = 0;
+	
+	//deflates at the given level (0-9, or more if the backend has them; others are clamped), returns output size or 0 on error
+	virtual size_t deflate(const uint8_t* in, size_t in_len, uint8_t* out, size_t out_max, int level) = 0;
+};
+
+//codec used by the library: libdeflate when built with TES4LIB_USE_LIBDEFLATE, zlib otherwise
+ZipCodec* get_zip_codec();
+
+//replaces it (do it before anything is loaded or saved); NULL restores the default
+void set_zip_codec(ZipCodec* codec);
+
+//zlib is always there (its output is byte-compatible with the older saves)
+ZipCodec* get_zlib_codec();
+
+}; //TES4
+
+#endif /* ZIP_CODEC_H_ */